@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "./semantics.h"
+
+/*
+ * Superinstructions.
+ *
+ * After code generation the bytecode of every function is rewritten
+ * replacing the most common sequences with a single instruction:
+ *
+ * GET_LOCAL 0 x; GET_LOCAL 0 y; LEQI       ->  LEQ_LOCALS x y
+ * GET_LOCAL 0 x; GET_LOCAL 0 y; SKIP_NLEQ n -> SKIP_NLEQ_LOCALS x y n
+ * GET_LOCAL 0 x; ONE; ADDI; SET_LOCAL 0 x  ->  INC_LOCAL x
+ * SKIPF n; POPV                            ->  SKIPF_POPV n
+ *
+ * A sequence is never fused if a jump lands inside it. Jump lengths are
+ * recomputed once the code has shrunk.
+ */
+
+static int fuse_at(struct bytecode *code, int ip, char *is_target, struct bytecode *out);
+static int jump_operand(uint8_t op);
+static uint16_t read_long_at(struct bytecode *code, int ip);
+
+void
+fuse_superinstructions(struct bytecode *code)
+{
+        int len = LIST_LEN(&code->code);
+        char *is_target = calloc(len + 1, 1);
+        int *new_ip = malloc(sizeof(int) * (len + 1));
+        int *old_ip = malloc(sizeof(int) * (len + 1));
+
+        for (int ip = 0; ip < len; ip += opcode_length(LIST_AT(&code->code, ip))) {
+                uint8_t op = LIST_AT(&code->code, ip);
+                if (opcode_is_jump(op))
+                        is_target[bytecode_jump_target(code, ip)] = 1;
+                else if (op == OP_LOCF_LONG)
+                        fuse_superinstructions(bytecode_constant_at(code, read_long_at(code, ip + 1)).function.code);
+        }
+
+        struct bytecode out;
+        bytes_init(&out.code);
+        linelist_init(&out.lines);
+        for (int ip = 0; ip < len; ) {
+                new_ip[ip] = LIST_LEN(&out.code);
+                old_ip[LIST_LEN(&out.code)] = ip;
+                ip = fuse_at(code, ip, is_target, &out);
+        }
+        new_ip[len] = LIST_LEN(&out.code);
+
+        for (int ip = 0; ip < LIST_LEN(&out.code); ip += opcode_length(LIST_AT(&out.code, ip))) {
+                uint8_t op = LIST_AT(&out.code, ip);
+                if (!opcode_is_jump(op))
+                        continue;
+                /* a fused jump is the last instruction of its sequence */
+                int oldjump = old_ip[ip];
+                while (!opcode_is_jump(LIST_AT(&code->code, oldjump)))
+                        oldjump += opcode_length(LIST_AT(&code->code, oldjump));
+                int target = new_ip[bytecode_jump_target(code, oldjump)];
+                int end = ip + opcode_length(op);
+                int jumplen = op == OP_SKIP_BACK_LONG ? end - target : target - end;
+                LIST_AT(&out.code, ip + jump_operand(op)) = left_byte(jumplen);
+                LIST_AT(&out.code, ip + jump_operand(op) + 1) = right_byte(jumplen);
+        }
+
+        bytes_free(&code->code);
+        linelist_free(&code->lines);
+        code->code = out.code;
+        code->lines = out.lines;
+        free(is_target);
+        free(new_ip);
+        free(old_ip);
+}
+
+/* copies or fuses the instruction at ip into out, returns the next ip */
+static int
+fuse_at(struct bytecode *code, int ip, char *is_target, struct bytecode *out)
+{
+        int len = LIST_LEN(&code->code);
+        uint8_t *p = code->code.buffer + ip;
+        struct lineinfo linfo = LIST_AT(&code->lines, ip);
+
+        if (p[0] == OP_GET_LOCAL_LONG && ip + 11 <= len && !is_target[ip + 5] && !is_target[ip + 10]
+                        && p[5] == OP_GET_LOCAL_LONG && p[10] == OP_LEQI
+                        && read_long_at(code, ip + 1) == 0 && read_long_at(code, ip + 6) == 0) {
+                linfo = LIST_AT(&code->lines, ip + 10);
+                bytecode_write_byte(out, OP_LEQ_LOCALS, linfo);
+                bytecode_write_long(out, read_long_at(code, ip + 3), linfo);
+                bytecode_write_long(out, read_long_at(code, ip + 8), linfo);
+                return ip + 11;
+        }
+        if (p[0] == OP_GET_LOCAL_LONG && ip + 13 <= len && !is_target[ip + 5] && !is_target[ip + 10]
+                        && p[5] == OP_GET_LOCAL_LONG && p[10] == OP_SKIP_NLEQ_LONG
+                        && read_long_at(code, ip + 1) == 0 && read_long_at(code, ip + 6) == 0) {
+                linfo = LIST_AT(&code->lines, ip + 10);
+                bytecode_write_byte(out, OP_SKIP_NLEQ_LOCALS, linfo);
+                bytecode_write_long(out, read_long_at(code, ip + 3), linfo);
+                bytecode_write_long(out, read_long_at(code, ip + 8), linfo);
+                bytecode_write_long(out, 0, linfo);
+                return ip + 13;
+        }
+        if (p[0] == OP_GET_LOCAL_LONG && ip + 12 <= len && !is_target[ip + 5] && !is_target[ip + 6] && !is_target[ip + 7]
+                        && p[5] == OP_ONE && p[6] == OP_ADDI && p[7] == OP_SET_LOCAL_LONG
+                        && read_long_at(code, ip + 1) == 0 && read_long_at(code, ip + 8) == 0
+                        && read_long_at(code, ip + 3) == read_long_at(code, ip + 10)) {
+                bytecode_write_byte(out, OP_INC_LOCAL, linfo);
+                bytecode_write_long(out, read_long_at(code, ip + 3), linfo);
+                return ip + 12;
+        }
+        if (p[0] == OP_SKIPF_LONG && ip + 4 <= len && !is_target[ip + 3] && p[3] == OP_POPV) {
+                bytecode_write_byte(out, OP_SKIPF_POPV, linfo);
+                bytecode_write_long(out, 0, linfo);
+                return ip + 4;
+        }
+
+        int next = ip + opcode_length(p[0]);
+        for (int i = ip; i < next; i++)
+                bytecode_write_byte(out, LIST_AT(&code->code, i), LIST_AT(&code->lines, i));
+        return next;
+}
+
+int
+opcode_length(uint8_t op)
+{
+        switch (op) {
+        case OP_LOCI_LONG:
+        case OP_LOCS_LONG:
+        case OP_LOCF_LONG:
+        case OP_SKIP_LONG:
+        case OP_SKIPF_LONG:
+        case OP_SKIP_BACK_LONG:
+        case OP_SKIPF_POPV:
+        case OP_SKIPF_POP_LONG:
+        case OP_SKIP_NLT_LONG:
+        case OP_SKIP_NLEQ_LONG:
+        case OP_SKIP_NGRT_LONG:
+        case OP_SKIP_NGRTEQ_LONG:
+        case OP_SKIP_NEQ_LONG:
+        case OP_SKIP_EQ_LONG:
+        case OP_INC_LOCAL:
+        case OP_UNPACK:
+        case OP_EQV:
+        case OP_SHIFT_ASTACKENT_TO_BASE:
+        case OP_ADDV:
+        case OP_SUBV:
+        case OP_MULV:
+        case OP_DIVV:
+        case OP_GRTV:
+        case OP_GRTEQV:
+        case OP_LTV:
+        case OP_LEQV:
+                return 3;
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_LEQ_LOCALS:
+        case OP_MATMUL:
+                return 5;
+        case OP_PUSH_BYTE:
+        case OP_WRITE:
+        case OP_CALL:
+        case OP_RETURN:
+        case OP_READ:
+        case OP_ARGSTACK_LOAD:
+        case OP_ASTACK_RELEASE:
+        case OP_ASTACK_SHIFT_UP:
+                return 2;
+        case OP_CALL_DIRECT:
+        case OP_TAILCALL:
+        case OP_GET_INDEX:
+        case OP_LOC_ALINK_LONG:
+        case OP_REDUCE:
+                return 4;
+        case OP_SKIP_NLEQ_LOCALS:
+                return 7;
+        case OP_SET_INDEX_LOCAL_LONG:
+        case OP_GET_ELEMENT_LOCAL_LONG:
+        case OP_SET_ELEMENT_LOCAL_LONG:
+        case OP_GET_ELEMENT_UNCHECKED_LONG:
+        case OP_SET_ELEMENT_UNCHECKED_LONG:
+                return 8;
+        case OP_GET_ELEMENT2_LOCAL_LONG:
+        case OP_SET_ELEMENT2_LOCAL_LONG:
+        case OP_GET_ELEMENT2_UNCHECKED_LONG:
+        case OP_SET_ELEMENT2_UNCHECKED_LONG:
+                return 10;
+        default:
+                return 1;
+        }
+}
+
+int
+opcode_is_jump(uint8_t op)
+{
+        switch (op) {
+        case OP_SKIP_LONG:
+        case OP_SKIPF_LONG:
+        case OP_SKIP_BACK_LONG:
+        case OP_SKIPF_POPV:
+        case OP_SKIPF_POP_LONG:
+        case OP_SKIP_NLT_LONG:
+        case OP_SKIP_NLEQ_LONG:
+        case OP_SKIP_NGRT_LONG:
+        case OP_SKIP_NGRTEQ_LONG:
+        case OP_SKIP_NEQ_LONG:
+        case OP_SKIP_EQ_LONG:
+        case OP_SKIP_NLEQ_LOCALS:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+/* position of the jump length within the instruction */
+static int
+jump_operand(uint8_t op)
+{
+        return op == OP_SKIP_NLEQ_LOCALS ? 5 : 1;
+}
+
+/* jump lengths are measured from the end of the jump instruction */
+int
+bytecode_jump_target(struct bytecode *code, int ip)
+{
+        uint8_t op = LIST_AT(&code->code, ip);
+        int jumplen = read_long_at(code, ip + jump_operand(op));
+        int end = ip + opcode_length(op);
+        if (op == OP_SKIP_BACK_LONG)
+                return end - jumplen;
+        return end + jumplen;
+}
+
+static uint16_t
+read_long_at(struct bytecode *code, int ip)
+{
+        return join_bytes(LIST_AT(&code->code, ip), LIST_AT(&code->code, ip + 1));
+}
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,9 +6,21 @@
 
 #include "semantics.h"
 
-static struct semantic_type emit_cond_expression(struct environment *env, struct tree_node *root);
+static struct semantic_type emit_cond_expression(struct environment *env, struct tree_node *root, int tail);
+static struct semantic_type emit_tail_expression(struct environment *env, struct tree_node *root);
 static struct semantic_type emit_indexing_expression(struct environment *env, struct tree_node *root);
-static struct semantic_type emit_module_call(struct environment *env, struct tree_node *root);
+static struct semantic_type emit_module_call(struct environment *env, struct tree_node *root, int tail);
+static int is_tail_callable(struct environment *env, struct tree_node *called, struct semantic_type called_type);
+static int module_index(struct environment *env, struct tree_node *called);
+static struct intrinsic *find_intrinsic(struct environment *env, struct tree_node *called);
+static struct semantic_type emit_reduction(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic);
+static struct semantic_type emit_matmul(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic);
+static struct semantic_type emit_concat(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic);
+static struct semantic_type emit_substring(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic);
+static struct semantic_type emit_length(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic);
+static int emit_scalar_arguments(struct environment *env, struct tree_node *root, enum value_type *expected, int count);
+static void emit_direct_call(struct environment *env, struct tree_node *root, enum opcode op, int module, int arity);
+static struct bytecode *program_code(struct environment *env);
 static void emit_for_statement(struct environment *env, struct tree_node *root);
 static int environment_local_search_check_write(struct environment *env, struct token name, struct tree_node *var, struct local_position *localpos);
 static struct semantic_type emit_lhs_prelude(struct environment *env, struct local_position localpos, struct tree_node *lhs);
@@ -27,12 +40,23 @@ static void pop_loop(struct environment *env);
 static void emit_break(struct environment *env, struct tree_node *node);
 static void patch_breaks(struct environment *env, struct tree_node *root);
 static void emit_pop_scope(struct environment *env, struct tree_node *node);
-static void emit_push_scope(struct environment *env, struct tree_node *node);
+static void emit_push_scope(struct environment *env);
 static int emit_skip_back_long(struct environment *env, struct tree_node *root, int codelen);
 static void emit_constant(struct environment *env, struct tree_node *root, union value val);
+static void emit_shape_constant(struct environment *env, struct tree_node *root, struct semantic_type type);
+static int is_element_access(struct semantic_type type, struct tree_node *indexing);
+static int is_in_bounds(struct environment *env, struct semantic_type type, struct tree_node *indexing);
+static int integer_range(struct environment *env, struct tree_node *root, int *min, int *max);
+static void emit_element_access(struct environment *env, struct tree_node *indexing, struct local_position localpos, struct semantic_type type, int store);
 static void emit_load_scalar_constant(struct environment *env, struct tree_node *root, enum value_type type, union value val);
 static struct semantic_type emit_vector_constant(struct environment *env, struct tree_node *root, int depth);
 static void emit_popv(struct environment *env, struct tree_node *node, struct semantic_type type);
+static int statement_allocates_vectors(struct environment *env, struct tree_node *root);
+static int allocates_vectors(struct environment *env, struct tree_node *root);
+static int call_allocates_vectors(struct environment *env, struct tree_node *root);
+static int may_be_vector(struct environment *env, struct tree_node *root);
+static struct semantic_type emit_vector_operation(struct environment *env, struct tree_node *root, struct semantic_type lefttype, struct semantic_type righttype);
+static void emit_vector_copy(struct environment *env, struct tree_node *root, struct semantic_type type);
 static void emit_byte(struct environment *env, struct tree_node *root, uint8_t byte);
 static void emit_two_bytes(struct environment *env, struct tree_node *root, uint8_t byte0, uint8_t byte1);
 static void emit_three_bytes(struct environment *env, struct tree_node *root, uint8_t byte0, uint8_t byte1, uint8_t byte2);
@@ -40,6 +64,8 @@ static struct semantic_type compute_indexed_semantic_type(struct environment *en
 static struct semantic_type emit_indexing_prelude(struct environment *env, struct semantic_type indexed_type, struct tree_node *indexing_node);
 static int emit_unpatched_skip_long(struct environment *env, struct tree_node *root, enum opcode op);
 static int patch_skip_long(struct environment *env, struct tree_node *root, int codelen);
+static int emit_unpatched_skip_unless(struct environment *env, struct tree_node *cond, struct semantic_type *condtype);
+static struct semantic_type emit_comparison(struct environment *env, struct tree_node *root, struct semantic_type lefttype, struct semantic_type righttype);
 static void environment_init(struct environment *env, struct environment *parent, struct bytecode *code);
 static void environment_free(struct environment *env);
 static int environment_local_search(struct environment *env, struct token name, struct local_position *localpos);
@@ -60,8 +86,11 @@ static struct semantic_type compute_lhs_type(struct environment *env, struct tre
 static void emit_set_local(struct environment *env, struct tree_node *lhs, struct local_position localpos);
 static struct semantic_type emit_vector_variable_copy(struct environment *env, struct tree_node *varnode, struct local_position localpos);
 static struct semantic_type emit_called_expression(struct environment *env, struct tree_node *root);
+static int can_pass_by_reference(struct environment *env, struct tree_node *call, struct semantic_type called_type, int argindex, int module);
+static int is_frame_unreachable(struct environment *env, struct bytecode *code, int level, char *visited);
 static struct semantic_type emit_id_expr(struct environment *env, struct tree_node *root, int array_by_ref);
 static void attach_dimensions(struct semantic_type *type, struct environment *env);
+static int stack_effect(struct bytecode *code, int ip);
 
 struct bytecode *
 generate_bytecode(struct tree_node *parsetree)
@@ -77,17 +106,156 @@ generate_bytecode(struct tree_node *parsetree)
                 return NULL;
         }
         emit_byte(&env, parsetree, OP_HALT);
+        fuse_superinstructions(code);
+        compute_max_stack(code);
         return code;
 }
 
+/*
+ * Walks the code in order, following the depth of the value stack along
+ * jumps, and stores the deepest it gets (counting the arguments) so that
+ * calls can check for overflow once instead of on every push.
+ */
+void
+compute_max_stack(struct bytecode *code)
+{
+        int len = LIST_LEN(&code->code);
+        int *depth_at = malloc(sizeof(int) * (len + 1));
+        int depth = 0;
+        for (int ip = 0; ip <= len; ip++)
+                depth_at[ip] = -1;
+        for (int ip = 0; ip < len; ip += opcode_length(LIST_AT(&code->code, ip))) {
+                uint8_t op = LIST_AT(&code->code, ip);
+                if (op == OP_LOCF_LONG)
+                        compute_max_stack(bytecode_constant_at(code, join_bytes(LIST_AT(&code->code, ip + 1), LIST_AT(&code->code, ip + 2))).function.code);
+                else if (op == OP_RETURN)
+                        depth = LIST_AT(&code->code, ip + 1); /* arity */
+        }
+
+        int maxdepth = depth;
+        int unreachable = 0;
+        for (int ip = 0; ip < len; ip += opcode_length(LIST_AT(&code->code, ip))) {
+                uint8_t op = LIST_AT(&code->code, ip);
+                if (unreachable || depth_at[ip] > depth)
+                        depth = depth_at[ip] >= 0 ? depth_at[ip] : depth;
+                if (opcode_is_jump(op)) {
+                        /* OP_SKIPF_POPV only pops when it does not jump */
+                        int jumpdepth = op == OP_SKIPF_POPV ? depth : depth + stack_effect(code, ip);
+                        int target = bytecode_jump_target(code, ip);
+                        if (jumpdepth > depth_at[target])
+                                depth_at[target] = jumpdepth;
+                }
+                depth += stack_effect(code, ip);
+                if (depth > maxdepth)
+                        maxdepth = depth;
+                unreachable = op == OP_SKIP_LONG || op == OP_SKIP_BACK_LONG || op == OP_RETURN
+                        || op == OP_TAILCALL || op == OP_HALT;
+        }
+        code->maxstack = maxdepth;
+        free(depth_at);
+}
+
+static int
+stack_effect(struct bytecode *code, int ip)
+{
+        uint8_t *p = code->code.buffer + ip;
+        switch (p[0]) {
+        case OP_LOCI_LONG:
+        case OP_LOCS_LONG:
+        case OP_LOCF_LONG:
+        case OP_PUSH_BYTE:
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EMPTY_STRING:
+        case OP_GET_LOCAL_LONG:
+        case OP_LEQ_LOCALS:
+        case OP_READ:
+        case OP_ARGSTACK_PEEK:
+        case OP_ASTACK_MARK:
+                return 1;
+        case OP_ADDI:
+        case OP_SUBI:
+        case OP_MULI:
+        case OP_DIVI:
+        case OP_GRTI:
+        case OP_GRTEQI:
+        case OP_LTI:
+        case OP_LEQI:
+        case OP_GRTS:
+        case OP_GRTEQS:
+        case OP_LTS:
+        case OP_LEQS:
+        case OP_EQI:
+        case OP_EQB:
+        case OP_EQS:
+        case OP_EQV:
+        case OP_ADDV:
+        case OP_SUBV:
+        case OP_MULV:
+        case OP_DIVV:
+        case OP_GRTV:
+        case OP_GRTEQV:
+        case OP_LTV:
+        case OP_LEQV:
+        case OP_CONCAT:
+        case OP_POPV:
+        case OP_SET_LOCAL_LONG:
+        case OP_POPA:
+        case OP_ASTACK_RELEASE:
+        case OP_SKIPF_POPV:
+        case OP_SKIPF_POP_LONG:
+                return -1;
+        case OP_SKIP_NLT_LONG:
+        case OP_SKIP_NLEQ_LONG:
+        case OP_SKIP_NGRT_LONG:
+        case OP_SKIP_NGRTEQ_LONG:
+        case OP_SKIP_NEQ_LONG:
+        case OP_SKIP_EQ_LONG:
+        case OP_MATMUL:
+        case OP_SUBSTRING:
+                return -2;
+        case OP_WRITE:
+                return -4 * p[1];
+        case OP_GET_INDEX:
+                return -p[3];
+        case OP_SET_INDEX_LOCAL_LONG:
+                return -(p[7] + 1);
+        case OP_GET_ELEMENT2_LOCAL_LONG:
+        case OP_GET_ELEMENT2_UNCHECKED_LONG:
+                return -1;
+        case OP_SET_ELEMENT_LOCAL_LONG:
+        case OP_SET_ELEMENT_UNCHECKED_LONG:
+                return -2;
+        case OP_SET_ELEMENT2_LOCAL_LONG:
+        case OP_SET_ELEMENT2_UNCHECKED_LONG:
+                return -3;
+        case OP_CALL:
+                return -p[1];
+        case OP_LOC_ALINK_LONG:
+                return 1 - bytecode_constant_at(code, join_bytes(p[1], p[2])).integer;
+        case OP_UNPACK:
+                return bytecode_constant_at(code, join_bytes(p[1], p[2])).shape->size - 1;
+        case OP_CALL_DIRECT:
+        case OP_TAILCALL:
+                return 1 - p[3];
+        default:
+                return 0;
+        }
+}
+
 void
 emit_statement(struct environment *env, struct tree_node *root)
 {
         struct tree_node *node;
         int count;
+        int temporaries = statement_allocates_vectors(env, root);
+        if (temporaries)
+                emit_byte(env, root, OP_ASTACK_MARK);
         switch (root->type) {
         case NODE_STAT_LIST:
-                emit_push_scope(env, root);
+                emit_push_scope(env);
                 node = root->child;
                 while (node != NULL) {
                         emit_statement(env, node);
@@ -114,6 +282,7 @@ emit_statement(struct environment *env, struct tree_node *root)
                         }
                         emit_two_bytes(env, node, OP_PUSH_BYTE, type.id);
                         emit_two_bytes(env, node, OP_PUSH_BYTE, type.base); /* eventually remove */
+                        emit_load_scalar_constant(env, node, VAL_INTEGER, value_from_c_int(type.size));
                         node = node->next;
                         count++;
                 }
@@ -160,7 +329,8 @@ emit_statement(struct environment *env, struct tree_node *root)
                 emit_for_statement(env, root);
                 break;
         case NODE_EXPR_STAT:
-                emit_popv(env, root, emit_expression(env, root->child));
+                emit_expression(env, root->child);
+                emit_byte(env, root, OP_POPV);
                 break;
         case NODE_PROGRAM:
                 emit_program_declaration(env, root);
@@ -175,9 +345,129 @@ emit_statement(struct environment *env, struct tree_node *root)
                 semantic_error(env, root, "semantic analysis for node not implemented (%s)", node_type_string(root->type));
                 break;
         }
+        if (temporaries)
+                emit_two_bytes(env, root, OP_ASTACK_RELEASE, 0);
         env->panic = 0;
 }
 
+/*
+ * Vector constants, vector results of calls and copies of vector
+ * arguments are allocated on the array stack. Simple statements that
+ * may create them release them once they are done.
+ */
+static int
+statement_allocates_vectors(struct environment *env, struct tree_node *root)
+{
+        switch (root->type) {
+        case NODE_WRITE_STAT:
+        case NODE_WRITELN_STAT:
+        case NODE_READ_STAT:
+        case NODE_ASSIGN_STAT:
+        case NODE_EXPR_STAT:
+                return allocates_vectors(env, root);
+        default:
+                return 0;
+        }
+}
+
+static int
+allocates_vectors(struct environment *env, struct tree_node *root)
+{
+        switch (root->type) {
+        case NODE_VECTOR_CONST:
+                return 1;
+        case NODE_MODULE_CALL:
+                if (call_allocates_vectors(env, root))
+                        return 1;
+                break;
+        case NODE_PLUS_EXPR:
+        case NODE_MINUS_EXPR:
+        case NODE_TIMES_EXPR:
+        case NODE_DIVIDE_EXPR:
+        case NODE_GREATER_EXPR:
+        case NODE_GREATEREQ_EXPR:
+        case NODE_LESS_EXPR:
+        case NODE_LESSEQ_EXPR:
+                /* whole vector operations leave their result on the array stack */
+                if (may_be_vector(env, root->left) || may_be_vector(env, root->right))
+                        return 1;
+                break;
+        default:
+                break;
+        }
+        struct tree_node *subtrees[] = {root->child, root->left, root->right};
+        for (int i = 0; i < 3; i++) {
+                for (struct tree_node *node = subtrees[i]; node != NULL; node = node->next) {
+                        if (allocates_vectors(env, node))
+                                return 1;
+                }
+        }
+        return 0;
+}
+
+/* false only for operands known to be scalars */
+static int
+may_be_vector(struct environment *env, struct tree_node *root)
+{
+        struct local_position localpos;
+        int index_count = 0;
+        switch (root->type) {
+        case NODE_INTGER_CONST:
+        case NODE_BOOLEAN_CONST:
+        case NODE_STRING_CONST:
+        case NODE_NEG_EXPR:
+        case NODE_NOT_EXPR:
+        case NODE_EQ_EXPR:
+        case NODE_NEQ_EXPR:
+        case NODE_AND_EXPR:
+        case NODE_OR_EXPR:
+                return 0;
+        case NODE_PLUS_EXPR:
+        case NODE_MINUS_EXPR:
+        case NODE_TIMES_EXPR:
+        case NODE_DIVIDE_EXPR:
+        case NODE_GREATER_EXPR:
+        case NODE_GREATEREQ_EXPR:
+        case NODE_LESS_EXPR:
+        case NODE_LESSEQ_EXPR:
+                return may_be_vector(env, root->left) || may_be_vector(env, root->right);
+        case NODE_ID:
+                return !environment_local_search(env, root->value, &localpos)
+                        || environment_local_get(env, localpos).type.id == VAL_VECTOR;
+        case NODE_INDEXING:
+                if (root->left->type != NODE_ID || !environment_local_search(env, root->left->value, &localpos))
+                        return 1;
+                for (struct tree_node *node = root->right; node != NULL; node = node->next)
+                        index_count++;
+                return environment_local_get(env, localpos).type.rank > index_count;
+        case NODE_MODULE_CALL:
+                return call_allocates_vectors(env, root);
+        default:
+                return 1;
+        }
+}
+
+/* calls taking and returning scalars only allocate nothing in the caller */
+static int
+call_allocates_vectors(struct environment *env, struct tree_node *root)
+{
+        struct local_position localpos;
+        if (find_intrinsic(env, root->left) != NULL)
+                return 0;
+        if (root->left->type != NODE_ID || !environment_local_search(env, root->left->value, &localpos))
+                return 1;
+        struct semantic_type type = environment_local_get(env, localpos).type;
+        if (type.id != VAL_FUNCTION)
+                return 1;
+        if (semantic_type_return_value(type).id == VAL_VECTOR)
+                return 1;
+        for (int i = 0; i < type.rank; i++) {
+                if (semantic_type_argument_at(type, i).id == VAL_VECTOR)
+                        return 1;
+        }
+        return 0;
+}
+
 struct semantic_type
 emit_expression(struct environment *env, struct tree_node *root)
 {
@@ -225,6 +515,8 @@ emit_expression(struct environment *env, struct tree_node *root)
         case NODE_DIVIDE_EXPR:
                 lefttype = emit_expression(env, root->left);
                 righttype = emit_expression(env, root->right);
+                if (lefttype.id == VAL_VECTOR || righttype.id == VAL_VECTOR)
+                        return emit_vector_operation(env, root, lefttype, righttype);
                 if (lefttype.id != VAL_INTEGER || righttype.id != VAL_INTEGER) {
                         semantic_error(env, root, "operands must be integers");
                 }
@@ -255,47 +547,15 @@ emit_expression(struct environment *env, struct tree_node *root)
                 return inttype;
         case NODE_EQ_EXPR:
         case NODE_NEQ_EXPR:
-                lefttype = emit_expression(env, root->left);
-                righttype = emit_expression(env, root->right);
-                if (lefttype.id == VAL_VOID || righttype.id == VAL_VOID) {
-                        semantic_error(env, root, "cannot use void type in '==' expression");
-                }
-                if (!semantic_type_equal(lefttype, righttype)) {
-                        semantic_error(env, root, "operands must be of the same type");
-                }
-                emit_three_bytes(env, root, OP_EQUA, lefttype.id, lefttype.base);
-                if (root->type == NODE_NEQ_EXPR) {
-                        emit_byte(env, root, OP_NOT);
-                }
-                return booltype;
         case NODE_GREATEREQ_EXPR:
         case NODE_GREATER_EXPR:
         case NODE_LESSEQ_EXPR:
         case NODE_LESS_EXPR:
                 lefttype = emit_expression(env, root->left);
                 righttype = emit_expression(env, root->right);
-                if (!semantic_types_comparable(lefttype, righttype)) {
-                        semantic_error(env, root, "operands must be both integers or both strings");
-                }
-                switch (root->type) {
-                case NODE_GREATEREQ_EXPR:
-                        emit_two_bytes(env, root, OP_GRTEQ, lefttype.id);
-                        break;
-                case NODE_GREATER_EXPR:
-                        emit_two_bytes(env, root, OP_GRT, lefttype.id);
-                        break;
-                case NODE_LESSEQ_EXPR:
-                        emit_two_bytes(env, root, OP_LEQ, lefttype.id);
-                        break;
-                case NODE_LESS_EXPR:
-                        emit_two_bytes(env, root, OP_LT, lefttype.id);
-                        break;
-                default:
-                        exit(100);
-                }
-                return booltype;
+                return emit_comparison(env, root, lefttype, righttype);
         case NODE_COND_EXPR:
-                return emit_cond_expression(env, root);
+                return emit_cond_expression(env, root, 0);
         case NODE_BOOLEAN_CONST:
                 emit_load_scalar_constant(env, root, VAL_BOOLEAN, value_from_c_bool(parse_boolean_token(root->value)));
                 return booltype;
@@ -312,21 +572,143 @@ emit_expression(struct environment *env, struct tree_node *root)
         case NODE_INDEXING:
                 return emit_indexing_expression(env, root);
         case NODE_MODULE_CALL:
-                return emit_module_call(env, root);
+                return emit_module_call(env, root, 0);
         default:
                 semantic_error(env, root, "semantic analysis for node not implemented (%s)", node_type_string(root->type));
         }
         return inttype;
 }
 
+/* elementwise on integer vectors of the same type, comparisons give boolean vectors */
 static struct semantic_type
-emit_called_expression(struct environment *env, struct tree_node *root)
+emit_vector_operation(struct environment *env, struct tree_node *root, struct semantic_type lefttype, struct semantic_type righttype)
 {
-        if (root->type != NODE_ID) {
-                return emit_expression(env, root);
+        if (lefttype.id != VAL_VECTOR || lefttype.base != VAL_INTEGER || !semantic_type_equal(lefttype, righttype)) {
+                semantic_error(env, root, "operands must be integer vectors of the same type");
+                return lefttype;
+        }
+        struct semantic_type toret = lefttype;
+        switch (root->type) {
+        case NODE_PLUS_EXPR:
+                emit_byte(env, root, OP_ADDV);
+                break;
+        case NODE_MINUS_EXPR:
+                emit_byte(env, root, OP_SUBV);
+                break;
+        case NODE_TIMES_EXPR:
+                emit_byte(env, root, OP_MULV);
+                break;
+        case NODE_DIVIDE_EXPR:
+                emit_byte(env, root, OP_DIVV);
+                break;
+        case NODE_GREATER_EXPR:
+                emit_byte(env, root, OP_GRTV);
+                toret.base = VAL_BOOLEAN;
+                break;
+        case NODE_GREATEREQ_EXPR:
+                emit_byte(env, root, OP_GRTEQV);
+                toret.base = VAL_BOOLEAN;
+                break;
+        case NODE_LESS_EXPR:
+                emit_byte(env, root, OP_LTV);
+                toret.base = VAL_BOOLEAN;
+                break;
+        case NODE_LESSEQ_EXPR:
+                emit_byte(env, root, OP_LEQV);
+                toret.base = VAL_BOOLEAN;
+                break;
+        default:
+                exit(100);
+        }
+        emit_shape_constant(env, root, lefttype);
+        return toret;
+}
+
+/* emits the comparison of the two operands already on the stack */
+static struct semantic_type
+emit_comparison(struct environment *env, struct tree_node *root, struct semantic_type lefttype, struct semantic_type righttype)
+{
+        switch (root->type) {
+        case NODE_EQ_EXPR:
+        case NODE_NEQ_EXPR:
+                if (lefttype.id == VAL_VOID || righttype.id == VAL_VOID) {
+                        semantic_error(env, root, "cannot use void type in '==' expression");
+                }
+                if (!semantic_type_equal(lefttype, righttype)) {
+                        semantic_error(env, root, "operands must be of the same type");
+                }
+                switch (lefttype.id) {
+                case VAL_INTEGER:
+                        emit_byte(env, root, OP_EQI);
+                        break;
+                case VAL_BOOLEAN:
+                        emit_byte(env, root, OP_EQB);
+                        break;
+                case VAL_STRING:
+                        emit_byte(env, root, OP_EQS);
+                        break;
+                case VAL_VECTOR:
+                        emit_byte(env, root, OP_EQV);
+                        emit_shape_constant(env, root, lefttype);
+                        break;
+                default:
+                        /* functions never compare equal */
+                        emit_byte(env, root, OP_POPV);
+                        emit_byte(env, root, OP_POPV);
+                        emit_byte(env, root, OP_FALSE);
+                        break;
+                }
+                if (root->type == NODE_NEQ_EXPR) {
+                        emit_byte(env, root, OP_NOT);
+                }
+                break;
+        default:
+                if (lefttype.id == VAL_VECTOR || righttype.id == VAL_VECTOR)
+                        return emit_vector_operation(env, root, lefttype, righttype);
+                if (!semantic_types_comparable(lefttype, righttype)) {
+                        semantic_error(env, root, "operands must be both integers or both strings");
+                }
+                int isstring = lefttype.id == VAL_STRING;
+                switch (root->type) {
+                case NODE_GREATEREQ_EXPR:
+                        emit_byte(env, root, isstring ? OP_GRTEQS : OP_GRTEQI);
+                        break;
+                case NODE_GREATER_EXPR:
+                        emit_byte(env, root, isstring ? OP_GRTS : OP_GRTI);
+                        break;
+                case NODE_LESSEQ_EXPR:
+                        emit_byte(env, root, isstring ? OP_LEQS : OP_LEQI);
+                        break;
+                case NODE_LESS_EXPR:
+                        emit_byte(env, root, isstring ? OP_LTS : OP_LTI);
+                        break;
+                default:
+                        exit(100);
+                }
+                break;
         }
-        return emit_id_expr(env, root, 0);
+        return semantic_type_scalar(VAL_BOOLEAN);
+}
 
+/* arguments never alias the storage of the caller */
+static struct semantic_type
+emit_called_expression(struct environment *env, struct tree_node *root)
+{
+        if (root->type == NODE_ID)
+                return emit_id_expr(env, root, 0);
+        struct semantic_type type = emit_expression(env, root);
+        if (type.id == VAL_VECTOR && root->type != NODE_VECTOR_CONST && root->type != NODE_MODULE_CALL)
+                emit_vector_copy(env, root, type);
+        return type;
+}
+
+/* OP_GET_INDEX without indices copies the vector on top of the array stack */
+static void
+emit_vector_copy(struct environment *env, struct tree_node *root, struct semantic_type type)
+{
+        emit_byte(env, root, OP_GET_INDEX);
+        emit_shape_constant(env, root, type);
+        emit_byte(env, root, 0);
 }
 
 static struct semantic_type
@@ -399,6 +781,18 @@ emit_constant(struct environment *env, struct tree_node *root, union value val)
         bytecode_write_constant(code, val, linfo);
 }
 
+/* strides are computed here once instead of at every access */
+static void
+emit_shape_constant(struct environment *env, struct tree_node *root, struct semantic_type type)
+{
+        int dimensions[MAX_VECTOR_DIMENSIONS];
+        for (int i = 0; i < type.rank && i < MAX_VECTOR_DIMENSIONS; i++)
+                dimensions[i] = semantic_type_dimension_at(type, i);
+        union value val;
+        val.shape = shape_from_dimensions(dimensions, type.rank < MAX_VECTOR_DIMENSIONS ? type.rank : MAX_VECTOR_DIMENSIONS, type.base);
+        emit_constant(env, root, val);
+}
+
 static void
 emit_load_scalar_constant(struct environment *env, struct tree_node *root, enum value_type type, union value val)
 {
@@ -451,6 +845,44 @@ patch_skip_long(struct environment *env, struct tree_node *root, int codelen)
         return 1;
 }
 
+/*
+ * Emits cond followed by a jump taken when it is false. The jump pops the
+ * condition, so neither path needs an OP_POPV. Integer comparisons become
+ * a single compare-and-branch instruction.
+ */
+static int
+emit_unpatched_skip_unless(struct environment *env, struct tree_node *cond, struct semantic_type *condtype)
+{
+        struct semantic_type lefttype, righttype;
+        enum opcode op;
+        /* temporaries are released before branching */
+        if (allocates_vectors(env, cond)) {
+                emit_byte(env, cond, OP_ASTACK_MARK);
+                *condtype = emit_expression(env, cond);
+                emit_two_bytes(env, cond, OP_ASTACK_RELEASE, 1);
+                return emit_unpatched_skip_long(env, cond, OP_SKIPF_POP_LONG);
+        }
+        switch (cond->type) {
+        case NODE_EQ_EXPR: op = OP_SKIP_NEQ_LONG; break;
+        case NODE_NEQ_EXPR: op = OP_SKIP_EQ_LONG; break;
+        case NODE_GREATEREQ_EXPR: op = OP_SKIP_NGRTEQ_LONG; break;
+        case NODE_GREATER_EXPR: op = OP_SKIP_NGRT_LONG; break;
+        case NODE_LESSEQ_EXPR: op = OP_SKIP_NLEQ_LONG; break;
+        case NODE_LESS_EXPR: op = OP_SKIP_NLT_LONG; break;
+        default:
+                *condtype = emit_expression(env, cond);
+                return emit_unpatched_skip_long(env, cond, OP_SKIPF_POP_LONG);
+        }
+        lefttype = emit_expression(env, cond->left);
+        righttype = emit_expression(env, cond->right);
+        if (lefttype.id != VAL_INTEGER || righttype.id != VAL_INTEGER) {
+                *condtype = emit_comparison(env, cond, lefttype, righttype);
+                return emit_unpatched_skip_long(env, cond, OP_SKIPF_POP_LONG);
+        }
+        *condtype = semantic_type_scalar(VAL_BOOLEAN);
+        return emit_unpatched_skip_long(env, cond, op);
+}
+
 static int
 emit_skip_back_long(struct environment *env, struct tree_node *root, int codelen)
 {
@@ -595,7 +1027,7 @@ environment_local_get(struct environment *env, struct local_position localpos)
 }
 
 static void
-emit_push_scope(struct environment *env, struct tree_node *node)
+emit_push_scope(struct environment *env)
 {
         env->depth++;
 }
@@ -625,11 +1057,7 @@ emit_variable_default(struct environment *env, struct tree_node *node, struct se
                 break;
         case VAL_VECTOR: {
                 emit_load_scalar_constant(env, node, VAL_INTEGER, value_from_c_int(type.size));
-                emit_byte(env, node, OP_ASTACK_SHIFT_UP);
-                emit_byte(env, node, OP_LOC_ALINK_LONG);
-                union value val;
-                val.vector.size = type.size;
-                emit_constant(env, node, val);
+                emit_two_bytes(env, node, OP_ASTACK_SHIFT_UP, type.base);
                 break;
         }
         case VAL_VOID:
@@ -690,6 +1118,8 @@ local_init(struct local *loc, struct token name, struct semantic_type type, int
         loc->type = type;
         loc->perms = perms;
         loc->depth = depth;
+        loc->module = -1;
+        loc->ranged = 0;
 }
 
 static struct local_position
@@ -740,13 +1170,11 @@ emit_if_statement(struct environment *env, struct tree_node *root)
         struct semantic_type type1 = semantic_type_scalar(VAL_INTEGER);
         child = root->child;
         while (child != NULL && child->type == NODE_CONDITION_AND_STATEMENT) {
-                type1 = emit_expression(env, child->left);
+                codelen = emit_unpatched_skip_unless(env, child->left, &type1);
                 if (type1.id != VAL_BOOLEAN) {
                         semantic_error(env, child->left, "if condition must be boolean");
                         return;
                 }
-                codelen = emit_unpatched_skip_long(env, child->left, OP_SKIPF_LONG);
-                emit_byte(env, child->left, OP_POPV);
                 emit_statement(env, child->right);
                 if (toendp - toendlens == MAX_CONDITIONAL_LEN) {
                         semantic_error(env, child, "maximum if-elsif chain (%d) exceeded", MAX_CONDITIONAL_LEN);
@@ -754,7 +1182,6 @@ emit_if_statement(struct environment *env, struct tree_node *root)
                 }
                 *toendp++ = emit_unpatched_skip_long(env, child, OP_SKIP_LONG);
                 patch_skip_long(env, child, codelen);
-                emit_byte(env, child, OP_POPV);
                 child = child->next;
         }
         if (child != NULL)
@@ -774,17 +1201,14 @@ emit_while_statement(struct environment *env, struct tree_node *root)
         struct semantic_type type1 = semantic_type_scalar(VAL_INTEGER);
         struct bytecode *code = env->code;
         startlen = LIST_LEN(&code->code);
-        type1 = emit_expression(env, root->left);
+        codelen = emit_unpatched_skip_unless(env, root->left, &type1);
         if (type1.id != VAL_BOOLEAN) {
                 semantic_error(env, root->left, "while condition must be boolean");
                 return;
         }
-        codelen = emit_unpatched_skip_long(env, root->left, OP_SKIPF_LONG);
-        emit_byte(env, root->left, OP_POPV);
         emit_statement(env, root->right);
         emit_skip_back_long(env, root->right, startlen);
         patch_skip_long(env, root, codelen);
-        emit_byte(env, root->left, OP_POPV);
 
         patch_breaks(env, root);
 
@@ -796,21 +1220,21 @@ emit_repeat_statement(struct environment *env, struct tree_node *root)
 {
         push_loop(env);
 
-        int startlen;
+        int codelen, startlen;
         struct semantic_type type1 = semantic_type_scalar(VAL_INTEGER);
         struct bytecode *code = env->code;
         startlen = LIST_LEN(&code->code);
 
         emit_statement(env, root->left);
 
-        type1 = emit_expression(env, root->right);
+        codelen = emit_unpatched_skip_unless(env, root->right, &type1);
         if (type1.id != VAL_BOOLEAN) {
                 semantic_error(env, root->right, "until condition must be boolean");
                 return;
         }
 
-        emit_three_bytes(env, root->right, OP_SKIPF_LONG, 0, 3);
         emit_skip_back_long(env, root->right, startlen);
+        patch_skip_long(env, root->right, codelen);
 
         patch_breaks(env, root);
 
@@ -864,7 +1288,6 @@ emit_indexing_prelude(struct environment *env, struct semantic_type indexed_type
         struct tree_node *indices_node = indexing_node->right;
         int index_count = 0;
 
-        /* emit indices */
         for (struct tree_node *node = indices_node; node != NULL; node = node->next) {
                 index_count++;
                 if (emit_expression(env, node).id != VAL_INTEGER) {
@@ -873,11 +1296,6 @@ emit_indexing_prelude(struct environment *env, struct semantic_type indexed_type
                 }
         }
 
-        /* emit dimensions */
-        for (int i = 0; i < indexed_type.rank; i++) {
-                emit_load_scalar_constant(env, indexing_node, VAL_INTEGER, value_from_c_int(semantic_type_dimension_at(indexed_type, i)));
-        }
-
         return compute_indexed_semantic_type(env, index_count, indexed_type);
 }
 
@@ -893,7 +1311,7 @@ emit_vector_variable_copy(struct environment *env, struct tree_node *varnode, st
 
         struct semantic_type indexed_type = environment_local_get(env, localpos).type;
         struct semantic_type toret = emit_indexing_prelude(env, indexed_type, &indexing);
-        emit_three_bytes(env, varnode, OP_GET_INDEX, 0, indexed_type.rank);
+        emit_vector_copy(env, varnode, indexed_type);
         return toret;
 }
 
@@ -904,9 +1322,13 @@ emit_op_set_local(struct environment *env, struct tree_node *node, struct local_
         struct local loc = environment_local_get(env, localpos);
         switch (loc.type.id) {
                 case VAL_VECTOR:
+                        if (is_element_access(loc.type, node)) {
+                                emit_element_access(env, node, localpos, loc.type, 1);
+                                break;
+                        }
                         emit_op_local_long(env, node, OP_SET_INDEX_LOCAL_LONG, localpos);
+                        emit_shape_constant(env, node, loc.type);
                         emit_byte(env, node, loc.type.rank - rhs_type.rank);
-                        emit_byte(env, node, loc.type.rank);
                         break;
                 default:
                         emit_op_local_long(env, node, OP_SET_LOCAL_LONG, localpos);
@@ -963,13 +1385,20 @@ emit_for_statement(struct environment *env, struct tree_node *root)
         forcond_node.next = NULL;
         forcond_node.value = forcond_token;
 
-        emit_push_scope(env, root);
+        emit_push_scope(env);
 
         struct semantic_type inttype = semantic_type_scalar(VAL_INTEGER);
         struct local_position incpos;
         emit_declare_local_default(env, assign->left, inttype, LOCAL_PERM_RW, &incpos);
         emit_assign_statement(env, assign);
-        LIST_AT(&env->locals, LIST_LEN(&env->locals) - 1).perms = LOCAL_PERM_R;
+        struct local *var = &LIST_AT(&env->locals, LIST_LEN(&env->locals) - 1);
+        var->perms = LOCAL_PERM_R;
+        int lower, upper, unused;
+        if (integer_range(env, assign->right, &lower, &unused) && integer_range(env, condition->right, &unused, &upper)) {
+                var->ranged = 1;
+                var->min = lower;
+                var->max = upper;
+        }
 
         struct local_position forcondpos;
         emit_declare_local_default(env, &forcond_node, inttype, LOCAL_PERM_R, &forcondpos);
@@ -987,9 +1416,7 @@ emit_for_statement(struct environment *env, struct tree_node *root)
         emit_op_local_long(env, root, OP_GET_LOCAL_LONG, incpos);
         emit_op_local_long(env, root, OP_GET_LOCAL_LONG, forcondpos);
 
-        emit_two_bytes(env, condition, OP_LEQ, VAL_INTEGER);
-        codelen = emit_unpatched_skip_long(env, condition, OP_SKIPF_LONG);
-        emit_byte(env, condition, OP_POPV);
+        codelen = emit_unpatched_skip_long(env, condition, OP_SKIP_NLEQ_LONG);
         emit_statement(env, statlist);
         emit_op_local_long(env, root, OP_GET_LOCAL_LONG, incpos);
         emit_byte(env, root, OP_ONE);
@@ -997,7 +1424,6 @@ emit_for_statement(struct environment *env, struct tree_node *root)
         emit_op_set_local(env, root, incpos, inttype);
         emit_skip_back_long(env, statlist, startlen);
         patch_skip_long(env, root, codelen);
-        emit_byte(env, condition, OP_POPV);
 
         patch_breaks(env, root);
 
@@ -1071,10 +1497,16 @@ forward_declare_function(struct environment *env, struct tree_node *root)
         struct tree_node *function_name_node = root->left;
 
         struct semantic_type fntype = build_function_semantic_type(env, root);
-        declare_local_in_env(env, function_name_node, fntype, LOCAL_PERM_R, NULL);
+        struct bytecode *program = program_code(env);
+        struct bytecode *subcode = malloc(sizeof(struct bytecode));
+        bytecode_init(subcode);
+        subcode->envindex = env->index + 1;
+        subcode->index = LIST_LEN(&program->functions);
+        codelist_push(&program->functions, subcode);
+        if (declare_local_in_env(env, function_name_node, fntype, LOCAL_PERM_R, NULL))
+                LIST_AT(&env->locals, LIST_LEN(&env->locals) - 1).module = subcode->index;
         union value fnval;
-        fnval.function.envindex = env->index + 1;
-        fnval.function.code = NULL;
+        fnval.function.code = subcode;
         emit_load_scalar_constant(env, root, VAL_FUNCTION, fnval);
         return env->code->constants.len - 1;
 }
@@ -1096,8 +1528,7 @@ patch_module_declaration(struct environment *env, struct tree_node *root, int ad
         struct semantic_type fntype = build_function_semantic_type(env, root);
 
         struct environment subenv;
-        struct bytecode *subcode = malloc(sizeof(struct bytecode));
-        bytecode_init(subcode);
+        struct bytecode *subcode = LIST_AT(&env->code->constants, addr).function.code;
         environment_init(&subenv, env, subcode);
 
         for (struct tree_node *node = arg_decls_node; node != NULL; node = node->next) {
@@ -1140,8 +1571,6 @@ patch_module_declaration(struct environment *env, struct tree_node *root, int ad
 
         environment_free(&subenv);
 
-        LIST_AT(&env->code->constants, addr).function.code = subcode;
-
         intlist_free(&addresses);
 }
 
@@ -1153,8 +1582,9 @@ emit_program_declaration(struct environment *env, struct tree_node *root)
                 semantic_error(env, root, "cannot have parameters in program (it is not a procedure)");
                 return;
         }
-        patch_module_declaration(env, root, forward_declare_function(env, root));
-        emit_two_bytes(env, root, OP_CALL, 0);
+        int addr = forward_declare_function(env, root);
+        patch_module_declaration(env, root, addr);
+        emit_direct_call(env, root, OP_CALL_DIRECT, LIST_AT(&env->code->constants, addr).function.code->index, 0);
 }
 
 static void
@@ -1212,7 +1642,7 @@ emit_body(struct environment *env, struct tree_node *statements_node, struct tre
                 struct semantic_type return_type, actual_ret_type;
                 if (return_type_node != NULL) {
                         return_type = type_node_to_type(env, return_type_node);
-                        actual_ret_type = emit_expression(env, ret_expr);
+                        actual_ret_type = emit_tail_expression(env, ret_expr);
                 } else {
                         return_type = semantic_type_void();
                         actual_ret_type = semantic_type_void();
@@ -1226,24 +1656,255 @@ emit_body(struct environment *env, struct tree_node *statements_node, struct tre
                         struct semantic_type arg_type = semantic_type_argument_at(fntype, i);
                         if ((arg_type.modifier & ARG_MOD_OUT) == 0)
                                 continue;
-                        emit_three_bytes(env, node, OP_ARGSTACK_LOAD, i, semantic_type_argument_at(fntype, i).id == VAL_VECTOR);
+                        emit_two_bytes(env, node, OP_ARGSTACK_LOAD, i);
                 }
-                if (return_type.id == VAL_VECTOR)
+                if (return_type.id == VAL_VECTOR) {
                         emit_byte(env, node, OP_SHIFT_ASTACKENT_TO_BASE);
+                        emit_shape_constant(env, node, return_type);
+                }
                 emit_two_bytes(env, node, OP_RETURN, arity);
         }
 }
 
+/* a call in tail position replaces the current frame instead of pushing a new one */
+static struct semantic_type
+emit_tail_expression(struct environment *env, struct tree_node *root)
+{
+        switch (root->type) {
+        case NODE_MODULE_CALL:
+                return emit_module_call(env, root, 1);
+        case NODE_COND_EXPR:
+                return emit_cond_expression(env, root, 1);
+        default:
+                return emit_expression(env, root);
+        }
+}
+
+/* the function table index of the called module, -1 if it is not known statically */
+static int
+module_index(struct environment *env, struct tree_node *called)
+{
+        struct local_position localpos;
+        if (called->type != NODE_ID || !environment_local_search(env, called->value, &localpos))
+                return -1;
+        return environment_local_get(env, localpos).module;
+}
+
+static void
+emit_direct_call(struct environment *env, struct tree_node *root, enum opcode op, int module, int arity)
+{
+        emit_three_bytes(env, root, op, left_byte(module), right_byte(module));
+        emit_byte(env, root, arity);
+}
+
+static struct bytecode *
+program_code(struct environment *env)
+{
+        while (env->parent != NULL)
+                env = env->parent;
+        return env->code;
+}
+
+/*
+ * The callee must be a declared module living outside the current one, as
+ * a nested module would still need the frame being reused. Out arguments
+ * and vector arguments are not moved along with the frame.
+ */
+static int
+is_tail_callable(struct environment *env, struct tree_node *called, struct semantic_type called_type)
+{
+        struct local_position localpos;
+        if (called->type != NODE_ID || !environment_local_search(env, called->value, &localpos))
+                return 0;
+        if (localpos.offset == 0 || environment_local_get(env, localpos).module < 0)
+                return 0;
+        for (int i = 0; i < called_type.rank; i++) {
+                struct semantic_type arg_type = semantic_type_argument_at(called_type, i);
+                if (arg_type.modifier != ARG_MOD_IN || arg_type.id == VAL_VECTOR)
+                        return 0;
+        }
+        return 1;
+}
+
+/*
+ * Modules implemented by the vm: reductions of a whole vector, of any rank,
+ * to a single value, the product of integer matrices and string
+ * operations. Their names are not reserved: a declared module with the
+ * same name hides them.
+ */
+struct intrinsic {
+        char *name;
+        struct semantic_type (*emit)(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic);
+        enum reduction kind;
+        enum value_type argument;
+        enum value_type result;
+};
+
+static struct intrinsic intrinsics[] = {
+        {"sum", emit_reduction, REDUCE_SUM, VAL_INTEGER, VAL_INTEGER},
+        {"min", emit_reduction, REDUCE_MIN, VAL_INTEGER, VAL_INTEGER},
+        {"max", emit_reduction, REDUCE_MAX, VAL_INTEGER, VAL_INTEGER},
+        {"count", emit_reduction, REDUCE_COUNT, VAL_BOOLEAN, VAL_INTEGER},
+        {"any", emit_reduction, REDUCE_ANY, VAL_BOOLEAN, VAL_BOOLEAN},
+        {"all", emit_reduction, REDUCE_ALL, VAL_BOOLEAN, VAL_BOOLEAN},
+        {"matmul", emit_matmul, 0, VAL_INTEGER, VAL_VOID},
+        {"concat", emit_concat, 0, VAL_STRING, VAL_STRING},
+        {"substring", emit_substring, 0, VAL_STRING, VAL_STRING},
+        {"length", emit_length, 0, VAL_STRING, VAL_INTEGER},
+        {NULL, NULL, 0, 0, 0},
+};
+
+static struct intrinsic *
+find_intrinsic(struct environment *env, struct tree_node *called)
+{
+        struct local_position localpos;
+        if (called->type != NODE_ID || environment_local_search(env, called->value, &localpos))
+                return NULL;
+        for (struct intrinsic *intrinsic = intrinsics; intrinsic->name != NULL; intrinsic++) {
+                if ((int) strlen(intrinsic->name) == called->value.length
+                                && strncmp(intrinsic->name, called->value.start, called->value.length) == 0)
+                        return intrinsic;
+        }
+        return NULL;
+}
+
 static struct semantic_type
-emit_module_call(struct environment *env, struct tree_node *root)
+emit_reduction(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic)
+{
+        struct semantic_type result = semantic_type_scalar(intrinsic->result);
+        if (root->right == NULL || root->right->next != NULL) {
+                semantic_error(env, root, "wrong number of arguments");
+                return result;
+        }
+        struct semantic_type arg_type = emit_expression(env, root->right);
+        if (arg_type.id != VAL_VECTOR || arg_type.base != intrinsic->argument) {
+                semantic_error(env, root->right, intrinsic->argument == VAL_INTEGER
+                                ? "expected integer vector" : "expected boolean vector");
+                return result;
+        }
+        emit_byte(env, root, OP_REDUCE);
+        emit_shape_constant(env, root, arg_type);
+        emit_byte(env, root, intrinsic->kind);
+        return result;
+}
+
+/* matmul(a, b, out c) with a of n x m, b of m x p and c of n x p integers */
+static struct semantic_type
+emit_matmul(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic)
+{
+        (void) intrinsic;
+        struct tree_node *args[3];
+        struct semantic_type types[3];
+        int argcount = 0;
+        for (struct tree_node *node = root->right; node != NULL; node = node->next) {
+                if (argcount < 3)
+                        args[argcount] = node;
+                argcount++;
+        }
+        if (argcount != 3) {
+                semantic_error(env, root, "wrong number of arguments");
+                return semantic_type_void();
+        }
+        struct tree_node *var = lhs_variable(args[2]);
+        struct local_position localpos;
+        if (var->type != NODE_ID) {
+                semantic_error(env, args[2], "expected lvalue");
+                return semantic_type_void();
+        }
+        if (!environment_local_search_check_write(env, var->value, var, &localpos))
+                return semantic_type_void();
+        for (int i = 0; i < 3; i++) {
+                types[i] = emit_expression(env, args[i]);
+                if (types[i].id != VAL_VECTOR || types[i].base != VAL_INTEGER || types[i].rank != 2) {
+                        semantic_error(env, args[i], "expected integer matrix");
+                        return semantic_type_void();
+                }
+        }
+        if (semantic_type_dimension_at(types[0], 1) != semantic_type_dimension_at(types[1], 0)
+                        || semantic_type_dimension_at(types[0], 0) != semantic_type_dimension_at(types[2], 0)
+                        || semantic_type_dimension_at(types[1], 1) != semantic_type_dimension_at(types[2], 1)) {
+                semantic_error(env, root, "mismatching matrix dimensions");
+                return semantic_type_void();
+        }
+        emit_byte(env, root, OP_MATMUL);
+        emit_shape_constant(env, root, types[0]);
+        emit_shape_constant(env, root, types[1]);
+        return semantic_type_void();
+}
+
+/* concat(a, b) */
+static struct semantic_type
+emit_concat(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic)
+{
+        enum value_type expected[] = {VAL_STRING, VAL_STRING};
+        if (emit_scalar_arguments(env, root, expected, 2))
+                emit_byte(env, root, OP_CONCAT);
+        return semantic_type_scalar(intrinsic->result);
+}
+
+/* substring(s, start, length), start counts from 0 */
+static struct semantic_type
+emit_substring(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic)
+{
+        enum value_type expected[] = {VAL_STRING, VAL_INTEGER, VAL_INTEGER};
+        if (emit_scalar_arguments(env, root, expected, 3))
+                emit_byte(env, root, OP_SUBSTRING);
+        return semantic_type_scalar(intrinsic->result);
+}
+
+/* length(s), in bytes */
+static struct semantic_type
+emit_length(struct environment *env, struct tree_node *root, struct intrinsic *intrinsic)
+{
+        enum value_type expected[] = {VAL_STRING};
+        if (emit_scalar_arguments(env, root, expected, 1))
+                emit_byte(env, root, OP_LENGTH);
+        return semantic_type_scalar(intrinsic->result);
+}
+
+static int
+emit_scalar_arguments(struct environment *env, struct tree_node *root, enum value_type *expected, int count)
+{
+        int argcount = 0;
+        for (struct tree_node *node = root->right; node != NULL; node = node->next)
+                argcount++;
+        if (argcount != count) {
+                semantic_error(env, root, "wrong number of arguments");
+                return 0;
+        }
+        int i = 0;
+        for (struct tree_node *node = root->right; node != NULL; node = node->next, i++) {
+                struct semantic_type type = emit_expression(env, node);
+                if (type.id != expected[i]) {
+                        semantic_error(env, node, "mismatching argument type");
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static struct semantic_type
+emit_module_call(struct environment *env, struct tree_node *root, int tail)
 {
         struct tree_node *called = root->left;
         struct semantic_type called_type;
         struct semantic_type dummy = semantic_type_scalar(VAL_INTEGER);
 
         struct tree_node *lhsides[MAX_ARITY];
+        int byref[MAX_ARITY];
+
+        struct intrinsic *intrinsic = find_intrinsic(env, called);
+        if (intrinsic != NULL)
+                return intrinsic->emit(env, root, intrinsic);
 
-        called_type = emit_expression(env, called);
+        int module = module_index(env, called);
+        if (module >= 0) {
+                struct local_position localpos;
+                environment_local_search(env, called->value, &localpos);
+                called_type = environment_local_get(env, localpos).type;
+        } else {
+                called_type = emit_expression(env, called);
+        }
         if (called_type.id != VAL_FUNCTION) {
                 semantic_error(env, called, "cannot call non callable variable");
                 return dummy;
@@ -1261,6 +1922,8 @@ emit_module_call(struct environment *env, struct tree_node *root)
                         }
                         lhsides[argcount - 1] = expr_node;
                 }
+                byref[argcount - 1] = arg_type.id == VAL_VECTOR && lhsides[argcount - 1] != NULL
+                        && can_pass_by_reference(env, root, called_type, argcount - 1, module);
                 if ((arg_type.modifier & ARG_MOD_IN) == 0) {
                         struct tree_node *var = lhs_variable(expr_node);
                         struct local_position localpos;
@@ -1269,7 +1932,7 @@ emit_module_call(struct environment *env, struct tree_node *root)
                         emit_variable_default(env, expr_node, compute_lhs_type(env, expr_node));
                         emit_set_local(env, expr_node, localpos);
                 }
-                struct semantic_type expr_type = emit_called_expression(env, expr_node);
+                struct semantic_type expr_type = byref[argcount - 1] ? emit_expression(env, expr_node) : emit_called_expression(env, expr_node);
                 if (!semantic_type_equal(semantic_type_argument_at(called_type, argcount - 1), expr_type)) {
                         semantic_error(env, expr_node, "mismatching argument type");
                         return dummy;
@@ -1279,7 +1942,14 @@ emit_module_call(struct environment *env, struct tree_node *root)
                 semantic_error(env, root, "wrong number of arguments");
                 return dummy;
         }
-        emit_two_bytes(env, root, OP_CALL, called_type.rank);
+        if (module >= 0 && tail && is_tail_callable(env, called, called_type)) {
+                emit_direct_call(env, root, OP_TAILCALL, module, called_type.rank);
+                return semantic_type_return_value(called_type);
+        }
+        if (module >= 0)
+                emit_direct_call(env, root, OP_CALL_DIRECT, module, called_type.rank);
+        else
+                emit_two_bytes(env, root, OP_CALL, called_type.rank);
         for (int i = 0; i < argcount; i++) {
                 if (!lhsides[i])
                         continue;
@@ -1287,13 +1957,106 @@ emit_module_call(struct environment *env, struct tree_node *root)
                 struct local_position localpos;
                 if (!environment_local_search_check_write(env, var->value, var, &localpos))
                         break;
-                emit_byte(env, lhsides[i], OP_ARGSTACK_PEEK);
-                emit_set_local(env, lhsides[i], localpos);
-                emit_two_bytes(env, lhsides[i], OP_ARGSTACK_UNLOAD, semantic_type_argument_at(called_type, i).id == VAL_VECTOR);
+                if (!byref[i]) {
+                        emit_byte(env, lhsides[i], OP_ARGSTACK_PEEK);
+                        emit_set_local(env, lhsides[i], localpos);
+                }
+                emit_byte(env, lhsides[i], OP_ARGSTACK_UNLOAD);
         }
         return semantic_type_return_value(called_type);
 }
 
+/*
+ * Vector out arguments are passed as a reference to the storage of the
+ * caller, unless the callee could tell: when another out argument names
+ * the same variable, or when code the callee may run reaches the frame
+ * holding the variable.
+ */
+static int
+can_pass_by_reference(struct environment *env, struct tree_node *call, struct semantic_type called_type, int argindex, int module)
+{
+        struct tree_node *arg = call->right;
+        for (int i = 0; i < argindex; i++)
+                arg = arg->next;
+        struct tree_node *var = lhs_variable(arg);
+        struct local_position localpos;
+        if (module < 0 || var->type != NODE_ID || !environment_local_search(env, var->value, &localpos))
+                return 0;
+
+        int i = 0;
+        for (struct tree_node *node = call->right; node != NULL && i < called_type.rank; node = node->next, i++) {
+                if (i == argindex || (semantic_type_argument_at(called_type, i).modifier & ARG_MOD_OUT) == 0)
+                        continue;
+                if (lhs_variable(node)->type == NODE_ID && token_equal(lhs_variable(node)->value, var->value))
+                        return 0;
+        }
+
+        struct environment *owner = env;
+        for (int offset = 0; offset < localpos.offset; offset++)
+                owner = owner->parent;
+        struct bytecode *program = program_code(env);
+        char *visited = calloc(LIST_LEN(&program->functions), 1);
+        int res = is_frame_unreachable(env, LIST_AT(&program->functions, module), owner->code->envindex, visited);
+        free(visited);
+        return res;
+}
+
+/* no local access of code, or of the code it can call, lands on the frame at level */
+static int
+is_frame_unreachable(struct environment *env, struct bytecode *code, int level, char *visited)
+{
+        struct bytecode *program = program_code(env);
+        if (visited[code->index])
+                return 1;
+        visited[code->index] = 1;
+
+        /* modules still being compiled are not known yet */
+        if (LIST_LEN(&code->code) == 0)
+                return 0;
+        for (struct environment *e = env; e != NULL; e = e->parent) {
+                if (e->code == code)
+                        return 0;
+        }
+
+        for (int ip = 0; ip < LIST_LEN(&code->code); ip += opcode_length(LIST_AT(&code->code, ip))) {
+                uint8_t *p = code->code.buffer + ip;
+                struct bytecode *callee;
+                switch (p[0]) {
+                case OP_GET_LOCAL_LONG:
+                case OP_SET_LOCAL_LONG:
+                case OP_SET_INDEX_LOCAL_LONG:
+                case OP_GET_ELEMENT_LOCAL_LONG:
+                case OP_GET_ELEMENT2_LOCAL_LONG:
+                case OP_SET_ELEMENT_LOCAL_LONG:
+                case OP_SET_ELEMENT2_LOCAL_LONG:
+                case OP_GET_ELEMENT_UNCHECKED_LONG:
+                case OP_GET_ELEMENT2_UNCHECKED_LONG:
+                case OP_SET_ELEMENT_UNCHECKED_LONG:
+                case OP_SET_ELEMENT2_UNCHECKED_LONG:
+                        /* outer frames are found by nesting level */
+                        if (join_bytes(p[1], p[2]) > 0 && code->envindex - join_bytes(p[1], p[2]) == level)
+                                return 0;
+                        break;
+                case OP_LOCF_LONG:
+                        callee = bytecode_constant_at(code, join_bytes(p[1], p[2])).function.code;
+                        if (!is_frame_unreachable(env, callee, level, visited))
+                                return 0;
+                        break;
+                case OP_CALL_DIRECT:
+                case OP_TAILCALL:
+                        callee = LIST_AT(&program->functions, join_bytes(p[1], p[2]));
+                        if (!is_frame_unreachable(env, callee, level, visited))
+                                return 0;
+                        break;
+                case OP_CALL:
+                        return 0;
+                default:
+                        break;
+                }
+        }
+        return 1;
+}
+
 static struct semantic_type
 compute_lhs_type(struct environment *env, struct tree_node *lhs)
 {
@@ -1316,7 +2079,7 @@ compute_lhs_type(struct environment *env, struct tree_node *lhs)
 }
 
 static struct semantic_type
-emit_cond_expression(struct environment *env, struct tree_node *root)
+emit_cond_expression(struct environment *env, struct tree_node *root, int tail)
 {
         int toendlens[MAX_CONDITIONAL_LEN];
         int codelen, *toendp;
@@ -1327,14 +2090,12 @@ emit_cond_expression(struct environment *env, struct tree_node *root)
         type1 = semantic_type_scalar(VAL_INTEGER);
         child = root->child;
         while (child != NULL && child->type == NODE_CONDITION_AND_EXPRESSION) {
-                type1 = emit_expression(env, child->left);
+                codelen = emit_unpatched_skip_unless(env, child->left, &type1);
                 if (type1.id != VAL_BOOLEAN) {
                         semantic_error(env, child->left, "if condition must be boolean");
                         return type0;
                 }
-                codelen = emit_unpatched_skip_long(env, child->left, OP_SKIPF_LONG);
-                emit_byte(env, child->left, OP_POPV);
-                type1 = emit_expression(env, child->right);
+                type1 = tail ? emit_tail_expression(env, child->right) : emit_expression(env, child->right);
                 if (child == root->child)
                         type0 = type1;
                 if (type0.id != type1.id) {
@@ -1347,10 +2108,9 @@ emit_cond_expression(struct environment *env, struct tree_node *root)
                 }
                 *toendp++ = emit_unpatched_skip_long(env, child, OP_SKIP_LONG);
                 patch_skip_long(env, child, codelen);
-                emit_byte(env, child, OP_POPV);
                 child = child->next;
         }
-        type1 = emit_expression(env, child);
+        type1 = tail ? emit_tail_expression(env, child) : emit_expression(env, child);
         if (type0.id != type1.id) {
                 semantic_error(env, child, "conditional expression types must be the same");
                 return type0;
@@ -1367,6 +2127,16 @@ emit_indexing_expression(struct environment *env, struct tree_node *root)
 {
         struct tree_node *indexed = root->left;
         struct semantic_type indexed_type;
+        struct local_position localpos;
+
+        if (indexed->type == NODE_ID && environment_local_search(env, indexed->value, &localpos)) {
+                indexed_type = environment_local_get(env, localpos).type;
+                if (is_element_access(indexed_type, root)) {
+                        struct semantic_type toret = emit_indexing_prelude(env, indexed_type, root);
+                        emit_element_access(env, root, localpos, indexed_type, 0);
+                        return toret;
+                }
+        }
 
         indexed_type = emit_expression(env, indexed);
         if (indexed_type.id != VAL_VECTOR) {
@@ -1375,11 +2145,128 @@ emit_indexing_expression(struct environment *env, struct tree_node *root)
 
         struct semantic_type toret = emit_indexing_prelude(env, indexed_type, root);
 
-        emit_three_bytes(env, root, OP_GET_INDEX, indexed_type.rank - toret.rank, indexed_type.rank);
+        emit_byte(env, root, OP_GET_INDEX);
+        emit_shape_constant(env, root, indexed_type);
+        emit_byte(env, root, indexed_type.rank - toret.rank);
 
         return toret;
 }
 
+/* v[i] and m[i][j] on local vectors do not push the vector */
+static int
+is_element_access(struct semantic_type type, struct tree_node *indexing)
+{
+        int index_count = 0;
+        for (struct tree_node *node = indexing->right; node != NULL; node = node->next)
+                index_count++;
+        if (type.id != VAL_VECTOR || type.rank < 1 || type.rank > 2 || index_count != type.rank)
+                return 0;
+        for (int i = 0; i < type.rank; i++) {
+                if (semantic_type_dimension_at(type, i) > UINT16_MAX)
+                        return 0;
+        }
+        return 1;
+}
+
+/* every index is known to stay within its dimension */
+static int
+is_in_bounds(struct environment *env, struct semantic_type type, struct tree_node *indexing)
+{
+        int i = 0;
+        for (struct tree_node *node = indexing->right; node != NULL; node = node->next, i++) {
+                int min, max;
+                if (!integer_range(env, node, &min, &max))
+                        return 0;
+                if (min < 0 || max >= semantic_type_dimension_at(type, i))
+                        return 0;
+        }
+        return 1;
+}
+
+/*
+ * Interval of the values an integer expression can take. Only constants,
+ * for loop variables (which are read-only in the body) and sums and
+ * differences of those are known.
+ */
+static int
+integer_range(struct environment *env, struct tree_node *root, int *min, int *max)
+{
+        int lmin, lmax, rmin, rmax;
+        long long low, high;
+        struct local_position localpos;
+        switch (root->type) {
+        case NODE_INTGER_CONST:
+                low = 0;
+                for (int i = 0; i < root->value.length; i++) {
+                        low = low * 10 + root->value.start[i] - '0';
+                        if (low > INT_MAX)
+                                return 0;
+                }
+                high = low;
+                break;
+        case NODE_ID: {
+                /* locals of enclosing modules are not tracked */
+                if (!environment_local_search(env, root->value, &localpos) || localpos.offset != 0)
+                        return 0;
+                struct local loc = environment_local_get(env, localpos);
+                if (!loc.ranged)
+                        return 0;
+                low = loc.min;
+                high = loc.max;
+                break;
+        }
+        case NODE_NEG_EXPR:
+                if (!integer_range(env, root->right, &rmin, &rmax))
+                        return 0;
+                low = -(long long) rmax;
+                high = -(long long) rmin;
+                break;
+        case NODE_PLUS_EXPR:
+        case NODE_MINUS_EXPR:
+                if (!integer_range(env, root->left, &lmin, &lmax) || !integer_range(env, root->right, &rmin, &rmax))
+                        return 0;
+                if (root->type == NODE_PLUS_EXPR) {
+                        low = (long long) lmin + rmin;
+                        high = (long long) lmax + rmax;
+                } else {
+                        low = (long long) lmin - rmax;
+                        high = (long long) lmax - rmin;
+                }
+                break;
+        default:
+                return 0;
+        }
+        if (low < INT_MIN || high > INT_MAX)
+                return 0;
+        *min = low;
+        *max = high;
+        return 1;
+}
+
+/* the dimensions follow the local position, for bounds checking, then the base type */
+static void
+emit_element_access(struct environment *env, struct tree_node *indexing, struct local_position localpos, struct semantic_type type, int store)
+{
+        enum opcode op;
+        if (is_in_bounds(env, type, indexing)) {
+                if (type.rank == 1)
+                        op = store ? OP_SET_ELEMENT_UNCHECKED_LONG : OP_GET_ELEMENT_UNCHECKED_LONG;
+                else
+                        op = store ? OP_SET_ELEMENT2_UNCHECKED_LONG : OP_GET_ELEMENT2_UNCHECKED_LONG;
+        } else {
+                if (type.rank == 1)
+                        op = store ? OP_SET_ELEMENT_LOCAL_LONG : OP_GET_ELEMENT_LOCAL_LONG;
+                else
+                        op = store ? OP_SET_ELEMENT2_LOCAL_LONG : OP_GET_ELEMENT2_LOCAL_LONG;
+        }
+        emit_op_local_long(env, indexing, op, localpos);
+        for (int i = 0; i < type.rank; i++) {
+                int dimension = semantic_type_dimension_at(type, i);
+                emit_two_bytes(env, indexing, left_byte(dimension), right_byte(dimension));
+        }
+        emit_byte(env, indexing, type.base);
+}
+
 static struct semantic_type
 compute_indexed_semantic_type(struct environment *env, int index_count, struct semantic_type indexed_type)
 {
@@ -1391,9 +2278,9 @@ compute_indexed_semantic_type(struct environment *env, int index_count, struct s
                 toret.base = indexed_type.base;
                 toret.rank = indexed_type.rank - index_count;
                 attach_dimensions(&toret, env);
-                toret.size = 0;
+                toret.size = 1;
                 for (int i = index_count; i < indexed_type.rank; i++) {
-                        toret.size += semantic_type_dimension_at(indexed_type, i);
+                        toret.size *= semantic_type_dimension_at(indexed_type, i);
                         intlist_push(&env->dimensions, semantic_type_dimension_at(indexed_type, i));
                 }
         }
@@ -1405,8 +2292,12 @@ emit_vector_constant(struct environment *env, struct tree_node *root, int depth)
 {
         struct semantic_type toret;
         if (root->type != NODE_VECTOR_CONST) {
+                /* elements wait on the value stack, see OP_LOC_ALINK_LONG */
                 toret = emit_expression(env, root);
-                emit_byte(env, root, OP_POP_TO_ASTACK);
+                if (toret.id == VAL_VECTOR) {
+                        emit_byte(env, root, OP_UNPACK);
+                        emit_shape_constant(env, root, toret);
+                }
                 return toret;
         }
 
@@ -1433,10 +2324,8 @@ emit_vector_constant(struct environment *env, struct tree_node *root, int depth)
                 return toret;
 
         emit_byte(env, root, OP_LOC_ALINK_LONG);
-        union value val;
-        val.vector.astackent = NULL;
-        val.vector.size = toret.size;
-        emit_constant(env, root, val);
+        emit_constant(env, root, value_from_c_int(toret.size));
+        emit_byte(env, root, toret.base);
 
         return toret;
 }
@@ -1472,44 +2361,87 @@ opcodestring(enum opcode code)
 {
         switch (code) {
         case OP_ADDI: return "OP_ADDI";
+        case OP_ADDV: return "OP_ADDV";
         case OP_ARGSTACK_LOAD: return "OP_ARGSTACK_LOAD";
         case OP_ARGSTACK_PEEK: return "OP_ARGSTACK_PEEK";
         case OP_ARGSTACK_UNLOAD: return "OP_ARGSTACK_UNLOAD";
+        case OP_ASTACK_MARK: return "OP_ASTACK_MARK";
+        case OP_ASTACK_RELEASE: return "OP_ASTACK_RELEASE";
         case OP_ASTACK_SHIFT_UP: return "OP_ASTACK_SHIFT_UP";
         case OP_CALL: return "OP_CALL";
+        case OP_CALL_DIRECT: return "OP_CALL_DIRECT";
+        case OP_CONCAT: return "OP_CONCAT";
         case OP_DIVI: return "OP_DIVI";
+        case OP_DIVV: return "OP_DIVV";
         case OP_EMPTY_STRING: return "OP_EMPTY_STRING";
-        case OP_EQUA: return "OP_EQUA";
+        case OP_EQB: return "OP_EQB";
+        case OP_EQI: return "OP_EQI";
+        case OP_EQS: return "OP_EQS";
+        case OP_EQV: return "OP_EQV";
         case OP_FALSE: return "OP_FALSE";
+        case OP_GET_ELEMENT2_LOCAL_LONG: return "OP_GET_ELEMENT2_LOCAL_LONG";
+        case OP_GET_ELEMENT_LOCAL_LONG: return "OP_GET_ELEMENT_LOCAL_LONG";
+        case OP_GET_ELEMENT2_UNCHECKED_LONG: return "OP_GET_ELEMENT2_UNCHECKED_LONG";
+        case OP_GET_ELEMENT_UNCHECKED_LONG: return "OP_GET_ELEMENT_UNCHECKED_LONG";
         case OP_GET_INDEX: return "OP_GET_INDEX";
         case OP_GET_LOCAL_LONG: return "OP_GET_LOCAL_LONG";
-        case OP_GRTEQ: return "OP_GRTEQ";
-        case OP_GRT: return "OP_GRT";
+        case OP_GRTEQI: return "OP_GRTEQI";
+        case OP_GRTEQS: return "OP_GRTEQS";
+        case OP_GRTEQV: return "OP_GRTEQV";
+        case OP_GRTI: return "OP_GRTI";
+        case OP_GRTS: return "OP_GRTS";
+        case OP_GRTV: return "OP_GRTV";
         case OP_HALT: return "OP_HALT";
-        case OP_LEQ: return "OP_LEQ";
+        case OP_INC_LOCAL: return "OP_INC_LOCAL";
+        case OP_LENGTH: return "OP_LENGTH";
+        case OP_LEQI: return "OP_LEQI";
+        case OP_LEQV: return "OP_LEQV";
+        case OP_LEQ_LOCALS: return "OP_LEQ_LOCALS";
+        case OP_LEQS: return "OP_LEQS";
         case OP_LOC_ALINK_LONG: return "OP_LOC_ALINK_LONG";
         case OP_LOCF_LONG: return "OP_LOCF_LONG";
         case OP_LOCI_LONG: return "OP_LOCI_LONG";
         case OP_LOCS_LONG: return "OP_LOCS_LONG";
-        case OP_LT: return "OP_LT";
+        case OP_LTI: return "OP_LTI";
+        case OP_LTS: return "OP_LTS";
+        case OP_LTV: return "OP_LTV";
+        case OP_MATMUL: return "OP_MATMUL";
         case OP_MULI: return "OP_MULI";
+        case OP_MULV: return "OP_MULV";
         case OP_NEWLINE: return "OP_NEWLINE";
         case OP_NOT: return "OP_NOT";
         case OP_ONE: return "OP_ONE";
         case OP_POPA: return "OP_POPA";
-        case OP_POP_TO_ASTACK: return "OP_POP_TO_ASTACK";
         case OP_POPV: return "OP_POPV";
         case OP_PUSH_BYTE: return "OP_PUSH_BYTE";
         case OP_READ: return "OP_READ";
+        case OP_REDUCE: return "OP_REDUCE";
         case OP_RETURN: return "OP_RETURN";
+        case OP_SET_ELEMENT2_LOCAL_LONG: return "OP_SET_ELEMENT2_LOCAL_LONG";
+        case OP_SET_ELEMENT_LOCAL_LONG: return "OP_SET_ELEMENT_LOCAL_LONG";
+        case OP_SET_ELEMENT2_UNCHECKED_LONG: return "OP_SET_ELEMENT2_UNCHECKED_LONG";
+        case OP_SET_ELEMENT_UNCHECKED_LONG: return "OP_SET_ELEMENT_UNCHECKED_LONG";
         case OP_SET_INDEX_LOCAL_LONG: return "OP_SET_INDEX_LOCAL_LONG";
         case OP_SET_LOCAL_LONG: return "OP_SET_LOCAL_LONG";
         case OP_SHIFT_ASTACKENT_TO_BASE: return "OP_SHIFT_ASTACKENT_TO_BASE";
         case OP_SKIP_BACK_LONG: return "OP_SKIP_BACK_LONG";
         case OP_SKIPF_LONG: return "OP_SKIPF_LONG";
+        case OP_SKIPF_POPV: return "OP_SKIPF_POPV";
+        case OP_SKIPF_POP_LONG: return "OP_SKIPF_POP_LONG";
+        case OP_SKIP_EQ_LONG: return "OP_SKIP_EQ_LONG";
+        case OP_SKIP_NEQ_LONG: return "OP_SKIP_NEQ_LONG";
+        case OP_SKIP_NGRTEQ_LONG: return "OP_SKIP_NGRTEQ_LONG";
+        case OP_SKIP_NGRT_LONG: return "OP_SKIP_NGRT_LONG";
+        case OP_SKIP_NLEQ_LOCALS: return "OP_SKIP_NLEQ_LOCALS";
+        case OP_SKIP_NLEQ_LONG: return "OP_SKIP_NLEQ_LONG";
+        case OP_SKIP_NLT_LONG: return "OP_SKIP_NLT_LONG";
         case OP_SKIP_LONG: return "OP_SKIP_LONG";
         case OP_SUBI: return "OP_SUBI";
+        case OP_SUBSTRING: return "OP_SUBSTRING";
+        case OP_SUBV: return "OP_SUBV";
+        case OP_TAILCALL: return "OP_TAILCALL";
         case OP_TRUE: return "OP_TRUE";
+        case OP_UNPACK: return "OP_UNPACK";
         case OP_WRITE: return "OP_WRITE";
         case OP_ZERO: return "OP_ZERO";
         }
@@ -1534,10 +2466,10 @@ disassemble_constant(struct bytecode *code, int ip, enum opcode loctype, int ind
         printf("(");
         switch (loctype) {
                 case OP_LOCI_LONG:
-                        value_print(v, VAL_INTEGER, VAL_INTEGER);
+                        value_print(v, VAL_INTEGER);
                         break;
                 case OP_LOCS_LONG:
-                        value_print(v, VAL_STRING, VAL_STRING);
+                        value_print(v, VAL_STRING);
                         break;
                 case OP_LOCF_LONG:
                         printf("\n");
@@ -1582,42 +2514,93 @@ disassemble_helper(struct bytecode *code, int indentation)
                 switch (instruction) {
                 case OP_LOCI_LONG:
                 case OP_LOCS_LONG:
-                case OP_LOC_ALINK_LONG:
                 case OP_LOCF_LONG:
                         ip = disassemble_constant(code, ip, instruction, indentation);
                         break;
+                case OP_LOC_ALINK_LONG:
+                        ip = disassemble_constant(code, ip, instruction, indentation);
+                        ip = disassemble_argument(code, ip);
+                        break;
                 case OP_SKIP_BACK_LONG:
                 case OP_SKIP_LONG:
                 case OP_SKIPF_LONG:
+                case OP_SKIPF_POPV:
+                case OP_SKIPF_POP_LONG:
+                case OP_SKIP_NLT_LONG:
+                case OP_SKIP_NLEQ_LONG:
+                case OP_SKIP_NGRT_LONG:
+                case OP_SKIP_NGRTEQ_LONG:
+                case OP_SKIP_NEQ_LONG:
+                case OP_SKIP_EQ_LONG:
+                case OP_INC_LOCAL:
+                case OP_UNPACK:
+                case OP_EQV:
+                case OP_SHIFT_ASTACKENT_TO_BASE:
+                case OP_ADDV:
+                case OP_SUBV:
+                case OP_MULV:
+                case OP_DIVV:
+                case OP_GRTV:
+                case OP_GRTEQV:
+                case OP_LTV:
+                case OP_LEQV:
+                        ip = disassemble_argument_long(code, ip);
+                        break;
+                case OP_SKIP_NLEQ_LOCALS:
+                        ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument_long(code, ip);
+                        break;
+                case OP_GET_ELEMENT_LOCAL_LONG:
+                case OP_SET_ELEMENT_LOCAL_LONG:
+                case OP_GET_ELEMENT_UNCHECKED_LONG:
+                case OP_SET_ELEMENT_UNCHECKED_LONG:
+                        ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument(code, ip);
+                        break;
+                case OP_GET_ELEMENT2_LOCAL_LONG:
+                case OP_SET_ELEMENT2_LOCAL_LONG:
+                case OP_GET_ELEMENT2_UNCHECKED_LONG:
+                case OP_SET_ELEMENT2_UNCHECKED_LONG:
+                        ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument_long(code, ip);
                         ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument_long(code, ip);
+                        ip = disassemble_argument(code, ip);
                         break;
                 case OP_GET_LOCAL_LONG:
                 case OP_SET_LOCAL_LONG:
+                case OP_LEQ_LOCALS:
+                case OP_MATMUL:
                         ip = disassemble_argument_long(code, ip);
                         ip = disassemble_argument_long(code, ip);
                         break;
-                case OP_LT:
-                case OP_LEQ:
-                case OP_GRT:
-                case OP_GRTEQ:
                 case OP_PUSH_BYTE:
                 case OP_WRITE:
                 case OP_CALL:
                 case OP_RETURN:
                 case OP_READ:
-                case OP_ARGSTACK_UNLOAD:
+                case OP_ARGSTACK_LOAD:
+                case OP_ASTACK_RELEASE:
+                case OP_ASTACK_SHIFT_UP:
                         ip = disassemble_argument(code, ip);
                         break;
                 case OP_GET_INDEX:
-                case OP_EQUA:
-                case OP_ARGSTACK_LOAD:
-                        ip = disassemble_argument(code, ip);
+                case OP_REDUCE:
+                        ip = disassemble_argument_long(code, ip);
                         ip = disassemble_argument(code, ip);
                         break;
                 case OP_SET_INDEX_LOCAL_LONG:
+                        ip = disassemble_argument_long(code, ip);
                         ip = disassemble_argument_long(code, ip);
                         ip = disassemble_argument_long(code, ip);
                         ip = disassemble_argument(code, ip);
+                        break;
+                case OP_CALL_DIRECT:
+                case OP_TAILCALL:
+                        ip = disassemble_argument_long(code, ip);
                         ip = disassemble_argument(code, ip);
                         break;
                 default:
@@ -31,6 +31,7 @@ enum opcode
         OP_LOCS_LONG,
         OP_LOCF_LONG,
         OP_LOC_ALINK_LONG,
+        OP_UNPACK, /* pushes the elements of a vector, for OP_LOC_ALINK_LONG */
 
         OP_PUSH_BYTE,
 
@@ -39,11 +40,34 @@ enum opcode
         OP_MULI,
         OP_DIVI,
 
-        OP_GRT, /* comparison */
-        OP_GRTEQ,
-        OP_LT,
-        OP_LEQ,
-        OP_EQUA,
+        OP_ADDV, /* integer vector arithmetic and comparison, elementwise */
+        OP_SUBV,
+        OP_MULV,
+        OP_DIVV,
+        OP_GRTV,
+        OP_GRTEQV,
+        OP_LTV,
+        OP_LEQV,
+        OP_REDUCE, /* whole vector to scalar, see enum reduction */
+        OP_MATMUL, /* product of the two integer matrices into the third */
+
+        OP_CONCAT, /* strings */
+        OP_SUBSTRING,
+        OP_LENGTH,
+
+        OP_GRTI, /* comparison */
+        OP_GRTEQI,
+        OP_LTI,
+        OP_LEQI,
+        OP_GRTS,
+        OP_GRTEQS,
+        OP_LTS,
+        OP_LEQS,
+
+        OP_EQI, /* equality */
+        OP_EQB,
+        OP_EQS,
+        OP_EQV,
 
         OP_NOT, /* boolean logic */
 
@@ -65,16 +89,27 @@ enum opcode
         OP_WRITE,
         OP_NEWLINE,
 
-        OP_POP_TO_ASTACK, /* array stack manipulation */
-        OP_POPA,
-        OP_ASTACK_SHIFT_UP,
+        OP_POPA, /* array stack manipulation */
+        OP_ASTACK_SHIFT_UP, /* pushes a default vector of the popped size */
+        OP_ASTACK_MARK, /* pushes the array stack top */
+        OP_ASTACK_RELEASE, /* frees the temporaries allocated since the mark */
 
         OP_GET_INDEX,
         OP_SET_INDEX_LOCAL_LONG,
+        OP_GET_ELEMENT_LOCAL_LONG, /* element of a local vector of rank 1 or 2 */
+        OP_GET_ELEMENT2_LOCAL_LONG,
+        OP_SET_ELEMENT_LOCAL_LONG,
+        OP_SET_ELEMENT2_LOCAL_LONG,
+        OP_GET_ELEMENT_UNCHECKED_LONG, /* indices proven in bounds */
+        OP_GET_ELEMENT2_UNCHECKED_LONG,
+        OP_SET_ELEMENT_UNCHECKED_LONG,
+        OP_SET_ELEMENT2_UNCHECKED_LONG,
 
         OP_READ,
 
         OP_CALL,
+        OP_CALL_DIRECT, /* call to a declared module, by function table index */
+        OP_TAILCALL, /* direct call reusing the current frame */
         OP_RETURN,
         OP_SHIFT_ASTACKENT_TO_BASE,
 
@@ -82,9 +117,32 @@ enum opcode
         OP_ARGSTACK_PEEK,
         OP_ARGSTACK_UNLOAD,
 
+        OP_LEQ_LOCALS, /* superinstructions */
+        OP_INC_LOCAL,
+        OP_SKIPF_POPV,
+
+        OP_SKIPF_POP_LONG, /* jumps popping their condition */
+        OP_SKIP_NLT_LONG, /* integer compare and branch */
+        OP_SKIP_NLEQ_LONG,
+        OP_SKIP_NGRT_LONG,
+        OP_SKIP_NGRTEQ_LONG,
+        OP_SKIP_NEQ_LONG,
+        OP_SKIP_EQ_LONG,
+        OP_SKIP_NLEQ_LOCALS,
+
         OP_HALT,
 };
 
+/* the byte operand of OP_REDUCE */
+enum reduction {
+        REDUCE_SUM, /* integer vectors */
+        REDUCE_MIN,
+        REDUCE_MAX,
+        REDUCE_COUNT, /* boolean vectors */
+        REDUCE_ANY,
+        REDUCE_ALL,
+};
+
 char *opcodestring(enum opcode code);
 
 enum value_type {
@@ -117,39 +175,81 @@ struct semantic_type {
 
 LIST_DECLARE(arg_types, struct semantic_type)
 
+/*
+ * Values refer to strings through descriptors, see copy_string and
+ * copy_runtime_string. Strings of up to SHORT_STRING_MAX bytes have no
+ * descriptor: their characters are packed in the pointer itself, tagged by
+ * its lowest bit. The empty string is the tag alone. Use string_length and
+ * string_chars to read either.
+ *
+ * Substrings and concatenations do not copy: a slice points into the
+ * characters of the string it was cut from, a rope holds its two halves
+ * until its characters are first needed.
+ */
 struct value_string {
-        char *str;
+        char *str; /* NULL until a rope is flattened */
         int length;
-        unsigned long hash;
+        unsigned char interned;
+        unsigned char marked;
+        unsigned long hash; /* 0 until needed, unless interned */
+        struct value_string *left; /* the string a slice points into, or the halves of a rope */
+        struct value_string *right;
 };
 
+#define SHORT_STRING_MAX ((int) sizeof(struct value_string *) - 1)
+#define IS_SHORT_STRING(s) (((uintptr_t) (s) & 1) != 0)
+
+/*
+ * Elements of integer and boolean vectors are packed, see
+ * vector_element_size. The size of a vector is known from its type, the
+ * instructions that need it take it as an operand.
+ */
 struct value_vector {
-        union value *astackent;
-        int size;
+        void *astackent;
 };
 
 struct value_function {
         struct bytecode *code;
-        int envindex;
+};
+
+/* dimensions and row-major strides of a vector type, used by indexing */
+struct value_shape {
+        int *dimensions;
+        int *strides;
+        int rank;
+        int size;
+        enum value_type base;
 };
 
 union value {
         int integer;
         int boolean;
-        struct value_string string;
+        struct value_string *string;
         struct value_vector vector;
         struct value_function function;
+        struct value_shape *shape;
 };
 
 struct run_type run_type_scalar(enum value_type id);
-void value_print(union value v, enum value_type type, enum value_type base);
+void value_print(union value v, enum value_type type);
+void vector_print(union value v, enum value_type base, int size);
 union value value_from_c_int(int i);
 union value value_from_c_bool(int b);
-struct value_string copy_string(char *str, int length);
+struct value_string *copy_string(char *str, int length);
+struct value_string *copy_runtime_string(char *str, int length);
+int string_length(struct value_string *s);
+char *string_chars(struct value_string *s, char *buf);
+struct value_string *concat_strings(struct value_string *s0, struct value_string *s1);
+struct value_string *slice_string(struct value_string *s, int start, int length);
+int string_count(void);
+void sweep_strings(void **roots, int count);
 unsigned long hash_string(char *str, int length);
 union value value_from_token(struct token token);
 union value value_from_c_string(char *str);
-int values_equal(union value val0, union value val1, enum value_type type, enum value_type base);
+int values_equal(union value val0, union value val1, enum value_type type);
+int strings_equal(struct value_string *s0, struct value_string *s1);
+int vectors_equal(union value val0, union value val1, enum value_type base, int size);
+int compare_strings(struct value_string *s0, struct value_string *s1);
 int semantic_types_comparable(struct semantic_type lefttype, struct semantic_type righttype);
 struct semantic_type semantic_type_return_value(struct semantic_type type);
 struct semantic_type semantic_type_argument_at(struct semantic_type type, int i);
@@ -159,9 +259,12 @@ int semantic_type_equal(struct semantic_type type0, struct semantic_type type1);
 struct semantic_type semantic_type_scalar(enum value_type vt);
 void semantic_type_print(struct semantic_type semantic_type);
 char *value_type_to_string(enum value_type vt);
-int index_flattened(int *dimensions, int *indices, int length);
-union value vector_value_get_element_at(union value vec, int i);
-void vector_value_set_element_at(union value vec, int i, union value val);
+struct value_shape *shape_from_dimensions(int *dimensions, int rank, enum value_type base);
+int vector_element_size(enum value_type base);
+int vector_storage_size(int size, enum value_type base);
+void *vector_element_address(union value vec, int i, enum value_type base);
+union value vector_value_get_element_at(union value vec, int i, enum value_type base);
+void vector_value_set_element_at(union value vec, int i, union value val, enum value_type base);
 uint8_t left_byte(uint16_t word);
 uint8_t right_byte(uint16_t word);
 uint16_t join_bytes(uint8_t left, uint8_t right);
@@ -182,10 +285,20 @@ LIST_DECLARE(linelist, struct lineinfo)
 LIST_DECLARE(valuelist, union value)
 LIST_DECLARE(intlist, int)
 
+struct instruction_stream;
+struct bytecode;
+
+LIST_DECLARE(codelist, struct bytecode *)
+
 struct bytecode {
         struct bytes code;
         struct linelist lines;
         struct valuelist constants;
+        int envindex; /* nesting level of the module */
+        int index; /* position in the function table */
+        int maxstack; /* deepest the value stack gets above the stack base */
+        struct codelist functions; /* function table, filled in the program code only */
+        struct instruction_stream *decoded; /* built by the vm before execution */
 };
 
 void bytecode_init(struct bytecode *code);
@@ -200,6 +313,11 @@ void disassemble(struct bytecode *code);
 void disassemble_helper(struct bytecode *code, int indentation);
 
 struct bytecode *generate_bytecode(struct tree_node *parsetree);
+void fuse_superinstructions(struct bytecode *code);
+void compute_max_stack(struct bytecode *code);
+int opcode_length(uint8_t op);
+int opcode_is_jump(uint8_t op);
+int bytecode_jump_target(struct bytecode *code, int ip);
 
 #define MAX_LOCALS UINT16_MAX
 
@@ -212,6 +330,10 @@ struct local {
         struct semantic_type type;
         int depth;
         uint8_t perms;
+        int module; /* function table index of a declared module, -1 otherwise */
+        int ranged; /* for loop variables with known bounds */
+        int min;
+        int max;
 };
 
 struct local_position {
@@ -6,6 +6,27 @@
 
 #include "./semantics.h"
 
+static struct value_string *short_string(char *str, int length);
+static void grow_interned(void);
+static void insert_interned(struct value_string *vs);
+static struct value_string *new_descriptor(int length, int extra);
+static void hash_descriptor(struct value_string *s);
+static void flatten(struct value_string *rope);
+static void mark_string(struct value_string *s);
+static int is_root(struct value_string *vs, void **roots, int count);
+static void free_string(struct value_string *vs);
+static int compare_addresses(const void *a, const void *b);
+
+/* the interned strings, see copy_string */
+static struct value_string **interned;
+static int interned_count;
+static int interned_capacity;
+
+/* the strings made while running, see copy_runtime_string */
+static struct value_string **strings;
+static int strings_count;
+static int strings_capacity;
+
 /* list */
 
 #define LIST_DEFINE(name, type) \
@@ -70,6 +91,7 @@ LIST_DEFINE(locals, struct local)
 LIST_DEFINE(break_likes, struct break_like)
 LIST_DEFINE(arg_types, struct semantic_type)
 LIST_DEFINE(intlist, int)
+LIST_DEFINE(codelist, struct bytecode *)
 
 void
 bytecode_init(struct bytecode *code)
@@ -77,6 +99,11 @@ bytecode_init(struct bytecode *code)
         bytes_init(&code->code);
         linelist_init(&code->lines);
         valuelist_init(&code->constants);
+        code->envindex = 0;
+        code->index = -1;
+        code->maxstack = 0;
+        codelist_init(&code->functions);
+        code->decoded = NULL;
 }
 
 int
@@ -119,7 +146,7 @@ bytecode_constant_at(struct bytecode *code, uint16_t address)
 }
 
 void
-value_print(union value v, enum value_type type, enum value_type base)
+value_print(union value v, enum value_type type)
 {
         switch (type) {
         case VAL_INTEGER:
@@ -128,17 +155,11 @@ value_print(union value v, enum value_type type, enum value_type base)
         case VAL_BOOLEAN:
                 printf("%s", v.boolean ? "true" : "false");
                 return;
-        case VAL_STRING:
-                printf("%.*s", v.string.length, v.string.str);
-                return;
-        case VAL_VECTOR:
-                printf("[");
-                for (int i = 0; i < v.vector.size; i++) {
-                        value_print(v.vector.astackent[i], base, base);
-                        printf(i == v.vector.size - 1 ? "" : ", ");
-                }
-                printf("]");
+        case VAL_STRING: {
+                char buf[SHORT_STRING_MAX];
+                printf("%.*s", string_length(v.string), string_chars(v.string, buf));
                 return;
+        }
         case VAL_FUNCTION:
                 printf("(");
                 disassemble_helper(v.function.code, 1);
@@ -150,6 +171,17 @@ value_print(union value v, enum value_type type, enum value_type base)
         }
 }
 
+void
+vector_print(union value v, enum value_type base, int size)
+{
+        printf("[");
+        for (int i = 0; i < size; i++) {
+                value_print(vector_value_get_element_at(v, i, base), base);
+                printf(i == size - 1 ? "" : ", ");
+        }
+        printf("]");
+}
+
 union value
 value_from_c_int(int i)
 {
@@ -166,43 +198,335 @@ value_from_c_bool(int b)
         return v;
 }
 
-/* http://www.cse.yorku.ca/~oz/hash.html */
+/*
+ * Eight bytes at a time, each word is mixed in with a rotate, a xor and a
+ * multiplication (as in FxHash). The last partial word is zero padded and
+ * the length is mixed in so that trailing zero bytes still count.
+ */
 unsigned long
 hash_string(char *str, int length)
 {
-        unsigned long hash = 5381;
-        int c;
-        for (int i = 0; i < length; i++) {
-                c = str[i];
-                hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+        uint64_t hash = (uint64_t) length;
+        uint64_t word;
+        int i = 0;
+        for (; i + 8 <= length; i += 8) {
+                memcpy(&word, str + i, 8);
+                hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ULL;
+        }
+        if (i < length) {
+                word = 0;
+                memcpy(&word, str + i, length - i);
+                hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ULL;
         }
-        return hash;
+        return (unsigned long) (hash ^ hash >> 32);
 }
 
-struct value_string
+/*
+ * Constants are interned: copy_string hands out the descriptor already
+ * holding the same characters when there is one, so equal constants are
+ * the same pointer. The table is an open addressing hash set kept at most
+ * half full. The characters are allocated together with the descriptor,
+ * right after it.
+ */
+struct value_string *
 copy_string(char *str, int length)
 {
-        struct value_string vs;
-        char *cp = malloc(sizeof(char) * length);
-        memcpy(cp, str, length);
-        vs.length = length;
-        vs.str = cp;
-        vs.hash = hash_string(str, length);
+        if (length <= SHORT_STRING_MAX)
+                return short_string(str, length);
+        unsigned long hash = hash_string(str, length) | 1;
+        if (2 * (interned_count + 1) > interned_capacity)
+                grow_interned();
+        unsigned long mask = interned_capacity - 1;
+        unsigned long i = hash & mask;
+        for (; interned[i] != NULL; i = (i + 1) & mask) {
+                struct value_string *vs = interned[i];
+                if (vs->hash == hash && vs->length == length && memcmp(vs->str, str, length) == 0)
+                        return vs;
+        }
+        struct value_string *vs = malloc(sizeof(struct value_string) + length);
+        vs->str = (char *) (vs + 1);
+        memcpy(vs->str, str, length);
+        vs->length = length;
+        vs->interned = 1;
+        vs->marked = 0;
+        vs->hash = hash;
+        vs->left = vs->right = NULL;
+        interned[i] = vs;
+        interned_count++;
+        return vs;
+}
+
+/*
+ * Strings read while running are not interned, most of them are never
+ * compared. Their hash is computed by the first equality test that needs
+ * it, see strings_equal.
+ */
+struct value_string *
+copy_runtime_string(char *str, int length)
+{
+        if (length <= SHORT_STRING_MAX)
+                return short_string(str, length);
+        struct value_string *vs = new_descriptor(length, length);
+        vs->str = (char *) (vs + 1);
+        memcpy(vs->str, str, length);
+        return vs;
+}
+
+/* the length goes above the tag, the characters in the following bytes */
+static struct value_string *
+short_string(char *str, int length)
+{
+        uintptr_t bits = 1 | (uintptr_t) length << 1;
+        for (int i = 0; i < length; i++)
+                bits |= (uintptr_t) (unsigned char) str[i] << 8 * (i + 1);
+        return (struct value_string *) bits;
+}
+
+int
+string_length(struct value_string *s)
+{
+        if (IS_SHORT_STRING(s))
+                return ((uintptr_t) s >> 1) & 0x7f;
+        return s->length;
+}
+
+/*
+ * The characters of a short string are unpacked into buf, of
+ * SHORT_STRING_MAX bytes. A rope is flattened first.
+ */
+char *
+string_chars(struct value_string *s, char *buf)
+{
+        if (!IS_SHORT_STRING(s)) {
+                if (s->str == NULL)
+                        flatten(s);
+                return s->str;
+        }
+        for (int i = 0; i < string_length(s); i++)
+                buf[i] = (char) ((uintptr_t) s >> 8 * (i + 1));
+        return buf;
+}
+
+/*
+ * Concatenation only allocates a rope node referring to both halves, so
+ * building a string piece by piece takes linear time. The characters are
+ * copied once, when they are first read.
+ */
+struct value_string *
+concat_strings(struct value_string *s0, struct value_string *s1)
+{
+        int len0 = string_length(s0), len1 = string_length(s1);
+        if (len0 == 0)
+                return s1;
+        if (len1 == 0)
+                return s0;
+        if (len0 + len1 <= SHORT_STRING_MAX) {
+                /* both halves are short, they are unpacked in place */
+                char buf[2 * SHORT_STRING_MAX];
+                string_chars(s0, buf);
+                string_chars(s1, buf + len0);
+                return short_string(buf, len0 + len1);
+        }
+        struct value_string *vs = new_descriptor(len0 + len1, 0);
+        vs->left = s0;
+        vs->right = s1;
         return vs;
+}
+
+/* the bounds are checked by the caller */
+struct value_string *
+slice_string(struct value_string *s, int start, int length)
+{
+        char buf[SHORT_STRING_MAX];
+        char *chars = string_chars(s, buf);
+        if (length <= SHORT_STRING_MAX)
+                return short_string(chars + start, length);
+        if (length == s->length)
+                return s;
+        struct value_string *vs = new_descriptor(length, 0);
+        vs->str = chars + start;
+        /* slices always point into a string that owns its characters */
+        vs->left = s->left != NULL ? s->left : s;
+        return vs;
+}
+
+/* extra bytes are allocated after the descriptor */
+static struct value_string *
+new_descriptor(int length, int extra)
+{
+        if (strings_count == strings_capacity) {
+                strings_capacity = strings_capacity == 0 ? 64 : strings_capacity * 2;
+                strings = realloc(strings, sizeof(struct value_string *) * strings_capacity);
+        }
+        struct value_string *vs = malloc(sizeof(struct value_string) + extra);
+        vs->str = NULL;
+        vs->length = length;
+        vs->interned = 0;
+        vs->marked = 0;
+        vs->hash = 0;
+        vs->left = vs->right = NULL;
+        strings[strings_count++] = vs;
+        return vs;
+}
+
+/* ropes can be deep, the pending halves are kept on an explicit stack */
+static void
+flatten(struct value_string *rope)
+{
+        char *str = malloc(rope->length);
+        int pos = 0;
+        int top = 0, capacity = 16;
+        struct value_string **pending = malloc(sizeof(struct value_string *) * capacity);
+        pending[top++] = rope;
+        while (top > 0) {
+                struct value_string *s = pending[--top];
+                if (IS_SHORT_STRING(s) || s->str != NULL) {
+                        char buf[SHORT_STRING_MAX];
+                        memcpy(str + pos, string_chars(s, buf), string_length(s));
+                        pos += string_length(s);
+                        continue;
+                }
+                if (top + 2 > capacity) {
+                        capacity *= 2;
+                        pending = realloc(pending, sizeof(struct value_string *) * capacity);
+                }
+                pending[top++] = s->right;
+                pending[top++] = s->left;
+        }
+        free(pending);
+        rope->str = str;
+        rope->left = rope->right = NULL;
+}
+
+static void
+grow_interned(void)
+{
+        int oldcapacity = interned_capacity;
+        struct value_string **old = interned;
+        interned_capacity = oldcapacity == 0 ? 64 : oldcapacity * 2;
+        interned = calloc(interned_capacity, sizeof(struct value_string *));
+        for (int j = 0; j < oldcapacity; j++) {
+                if (old[j] != NULL)
+                        insert_interned(old[j]);
+        }
+        free(old);
+}
+
+static void
+insert_interned(struct value_string *vs)
+{
+        unsigned long mask = interned_capacity - 1;
+        unsigned long i = vs->hash & mask;
+        while (interned[i] != NULL)
+                i = (i + 1) & mask;
+        interned[i] = vs;
+}
+
+/* the strings allocated so far, the vm uses it to decide when to collect */
+int
+string_count(void)
+{
+        return interned_count + strings_count;
+}
+
+/*
+ * Frees every string that is neither among the roots, which are sorted in
+ * place, nor reachable from one through slices and ropes. Roots are only
+ * compared against the descriptors, never dereferenced, so they can hold
+ * any value.
+ */
+void
+sweep_strings(void **roots, int count)
+{
+        qsort(roots, count, sizeof(void *), compare_addresses);
+        for (int j = 0; j < interned_capacity; j++) {
+                if (interned[j] != NULL && is_root(interned[j], roots, count))
+                        mark_string(interned[j]);
+        }
+        for (int j = 0; j < strings_count; j++) {
+                if (is_root(strings[j], roots, count))
+                        mark_string(strings[j]);
+        }
+
+        int capacity = interned_capacity;
+        struct value_string **old = interned;
+        interned = calloc(capacity, sizeof(struct value_string *));
+        interned_count = 0;
+        for (int j = 0; j < capacity; j++) {
+                if (old[j] == NULL)
+                        continue;
+                if (old[j]->marked) {
+                        old[j]->marked = 0;
+                        insert_interned(old[j]);
+                        interned_count++;
+                } else {
+                        free_string(old[j]);
+                }
+        }
+        free(old);
+
+        int live = 0;
+        for (int j = 0; j < strings_count; j++) {
+                if (strings[j]->marked) {
+                        strings[j]->marked = 0;
+                        strings[live++] = strings[j];
+                } else {
+                        free_string(strings[j]);
+                }
+        }
+        strings_count = live;
+}
+
+static void
+mark_string(struct value_string *s)
+{
+        int top = 0, capacity = 16;
+        struct value_string **pending = malloc(sizeof(struct value_string *) * capacity);
+        pending[top++] = s;
+        while (top > 0) {
+                s = pending[--top];
+                if (s == NULL || IS_SHORT_STRING(s) || s->marked)
+                        continue;
+                s->marked = 1;
+                if (top + 2 > capacity) {
+                        capacity *= 2;
+                        pending = realloc(pending, sizeof(struct value_string *) * capacity);
+                }
+                pending[top++] = s->left;
+                pending[top++] = s->right;
+        }
+        free(pending);
+}
 
+static int
+is_root(struct value_string *vs, void **roots, int count)
+{
+        void *key = vs;
+        return bsearch(&key, roots, count, sizeof(void *), compare_addresses) != NULL;
+}
+
+/* only flattened ropes allocate their characters separately */
+static void
+free_string(struct value_string *vs)
+{
+        if (vs->str != (char *) (vs + 1) && vs->left == NULL)
+                free(vs->str);
+        free(vs);
 }
 
-struct value_string
-value_string_from_token(struct token token)
+static int
+compare_addresses(const void *a, const void *b)
 {
-        return copy_string(token.start, token.length);
+        uintptr_t x = (uintptr_t) *(void **) a;
+        uintptr_t y = (uintptr_t) *(void **) b;
+        return (x > y) - (x < y);
 }
 
 union value
 value_from_token(struct token token)
 {
         union value v;
-        v.string = value_string_from_token(token);
+        v.string = copy_string(token.start, token.length);
         return v;
 }
 
@@ -251,7 +575,7 @@ semantic_type_scalar(enum value_type vt)
 }
 
 int
-values_equal(union value val0, union value val1, enum value_type type, enum value_type base)
+values_equal(union value val0, union value val1, enum value_type type)
 {
         switch (type) {
         case VAL_INTEGER:
@@ -259,17 +583,7 @@ values_equal(union value val0, union value val1, enum value_type type, enum valu
         case VAL_BOOLEAN:
                 return val0.boolean == val1.boolean;
         case VAL_STRING:
-                if (val0.string.hash != val1.string.hash)
-                        return 0;
-                return val0.string.length == val1.string.length && memcmp(val0.string.str, val1.string.str, val0.string.length) == 0;
-        case VAL_VECTOR:
-                for (int i = 0; i < val0.vector.size; i++) {
-                        union value ent0 = val0.vector.astackent[i];
-                        union value ent1 = val1.vector.astackent[i];
-                        if (!values_equal(ent0, ent1, base, base))
-                                return 0;
-                }
-                return 1;
+                return strings_equal(val0.string, val1.string);
         case VAL_FUNCTION:
                 return 0;
         default:
@@ -278,6 +592,54 @@ values_equal(union value val0, union value val1, enum value_type type, enum valu
         return 0;
 }
 
+/*
+ * Interned strings are equal only if they are the same descriptor, see
+ * copy_string. Short strings are never equal to a string with a
+ * descriptor, which is always longer. Other strings of the same length are
+ * told apart by their hashes before their characters are compared.
+ */
+int
+strings_equal(struct value_string *s0, struct value_string *s1)
+{
+        if (s0 == s1)
+                return 1;
+        if (IS_SHORT_STRING(s0) || IS_SHORT_STRING(s1) || (s0->interned && s1->interned))
+                return 0;
+        if (s0->length != s1->length)
+                return 0;
+        if (s0->hash == 0)
+                hash_descriptor(s0);
+        if (s1->hash == 0)
+                hash_descriptor(s1);
+        if (s0->hash != s1->hash)
+                return 0;
+        return memcmp(string_chars(s0, NULL), string_chars(s1, NULL), s0->length) == 0;
+}
+
+/* the lowest bit is set so that 0 stands for not computed yet */
+static void
+hash_descriptor(struct value_string *s)
+{
+        s->hash = hash_string(string_chars(s, NULL), s->length) | 1;
+}
+
+int
+vectors_equal(union value val0, union value val1, enum value_type base, int size)
+{
+        switch (base) {
+        case VAL_INTEGER:
+        case VAL_BOOLEAN:
+                /* packed elements compare bytewise */
+                return memcmp(val0.vector.astackent, val1.vector.astackent, size * vector_element_size(base)) == 0;
+        default:
+                for (int i = 0; i < size; i++) {
+                        if (!values_equal(vector_value_get_element_at(val0, i, base), vector_value_get_element_at(val1, i, base), base))
+                                return 0;
+                }
+                return 1;
+        }
+}
+
 int
 semantic_types_comparable(struct semantic_type lefttype, struct semantic_type righttype)
 {
@@ -293,15 +655,29 @@ compare_values(union value val0, union value val1, enum value_type type)
 {
         switch (type) {
                 case VAL_STRING:
-                        return memcmp(val0.string.str, val1.string.str, val0.string.length);
+                        return compare_strings(val0.string, val1.string);
                 case VAL_INTEGER:
-                        return val0.integer - val1.integer;
+                        return (val0.integer > val1.integer) - (val0.integer < val1.integer);
                 default:
                         exit(100);
                         return 0;
         }
 }
 
+/* lexicographic, a prefix sorts first */
+int
+compare_strings(struct value_string *s0, struct value_string *s1)
+{
+        if (s0 == s1)
+                return 0;
+        char buf0[SHORT_STRING_MAX], buf1[SHORT_STRING_MAX];
+        int len0 = string_length(s0), len1 = string_length(s1);
+        int cmp = memcmp(string_chars(s0, buf0), string_chars(s1, buf1), len0 < len1 ? len0 : len1);
+        if (cmp != 0)
+                return cmp;
+        return len0 - len1;
+}
+
 int
 semantic_type_equal(struct semantic_type type0, struct semantic_type type1)
 {
@@ -379,18 +755,79 @@ value_void()
         return value_from_c_int(0);
 }
 
+/* the dimensions and strides are allocated together with the shape */
+struct value_shape *
+shape_from_dimensions(int *dimensions, int rank, enum value_type base)
+{
+        struct value_shape *shape = malloc(sizeof(struct value_shape) + sizeof(int) * 2 * rank);
+        shape->rank = rank;
+        shape->base = base;
+        shape->dimensions = (int *) (shape + 1);
+        shape->strides = shape->dimensions + rank;
+        shape->size = 1;
+        for (int i = rank - 1; i >= 0; i--) {
+                shape->dimensions[i] = dimensions[i];
+                shape->strides[i] = shape->size;
+                shape->size *= dimensions[i];
+        }
+        return shape;
+}
+
+/* integers and booleans are packed, the other element types take a whole value */
 int
-index_flattened(int *dimensions, int *indices, int length)
+vector_element_size(enum value_type base)
 {
-        int res = 0;
-        for (int i = 0; i < length; i++) {
-                int term = indices[i];
-                for (int j = i + 1; j < length; j++) {
-                        term *= dimensions[j];
-                }
-                res += term;
+        switch (base) {
+        case VAL_INTEGER:
+                return sizeof(int32_t);
+        case VAL_BOOLEAN:
+                return sizeof(uint8_t);
+        default:
+                return sizeof(union value);
+        }
+}
+
+/* bytes taken on the array stack, rounded up so that it stays aligned */
+int
+vector_storage_size(int size, enum value_type base)
+{
+        int bytes = size * vector_element_size(base);
+        return (bytes + sizeof(union value) - 1) / sizeof(union value) * sizeof(union value);
+}
+
+void *
+vector_element_address(union value vec, int i, enum value_type base)
+{
+        return (char *) vec.vector.astackent + i * vector_element_size(base);
+}
+
+union value
+vector_value_get_element_at(union value vec, int i, enum value_type base)
+{
+        switch (base) {
+        case VAL_INTEGER:
+                return value_from_c_int(((int32_t *) vec.vector.astackent)[i]);
+        case VAL_BOOLEAN:
+                return value_from_c_bool(((uint8_t *) vec.vector.astackent)[i]);
+        default:
+                return ((union value *) vec.vector.astackent)[i];
+        }
+}
+
+void
+vector_value_set_element_at(union value vec, int i, union value val, enum value_type base)
+{
+        switch (base) {
+        case VAL_INTEGER:
+                ((int32_t *) vec.vector.astackent)[i] = val.integer;
+                break;
+        case VAL_BOOLEAN:
+                ((uint8_t *) vec.vector.astackent)[i] = val.boolean;
+                break;
+        default:
+                ((union value *) vec.vector.astackent)[i] = val;
+                break;
         }
-        return res;
 }
 
 uint8_t
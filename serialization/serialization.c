@@ -8,8 +8,10 @@ static void serialize_code(struct bytecode *code, FILE *outfile);
 static void serialize_loc(struct bytecode *code, FILE *outfile, enum opcode op, uint16_t address);
 static uint16_t read_address(struct bytecode *code, int *ip);
 static void serialize_constants(struct bytecode *code, FILE *outfile);
+static void serialize_shape(struct bytecode *code, FILE *outfile, uint16_t address);
 
 #define END_FUNCTION_DELIM (-1)
+#define SHAPE_CONSTANT (-2)
 
 void
 serialize_bytecode(struct bytecode *code, FILE *outfile)
@@ -39,17 +41,19 @@ serialize_loc(struct bytecode *code, FILE *outfile, enum opcode op, uint16_t add
                 fprintf(outfile, "%d %d", VAL_INTEGER, val.integer);
                 fprintf(outfile, "\n");
                 break;
-        case OP_LOCS_LONG:
-                fprintf(outfile, "%d %.*s", VAL_STRING, val.string.length, val.string.str);
+        case OP_LOCS_LONG: {
+                char buf[SHORT_STRING_MAX];
+                fprintf(outfile, "%d %.*s", VAL_STRING, string_length(val.string), string_chars(val.string, buf));
                 {char n = 0x00; fwrite(&n, sizeof(char), 1, outfile);}
                 fprintf(outfile, "\n");
                 break;
+        }
         case OP_LOC_ALINK_LONG:
-                fprintf(outfile, "%d %d", VAL_VECTOR, val.vector.size);
+                fprintf(outfile, "%d %d", VAL_VECTOR, val.integer);
                 fprintf(outfile, "\n");
                 break;
         case OP_LOCF_LONG:
-                fprintf(outfile, "%d ", VAL_FUNCTION);
+                fprintf(outfile, "%d %d %d ", VAL_FUNCTION, val.function.code->envindex, val.function.code->index);
                 serialize_bytecode(val.function.code, outfile);
                 break;
         default:
@@ -58,6 +62,16 @@ serialize_loc(struct bytecode *code, FILE *outfile, enum opcode op, uint16_t add
         }
 }
 
+static void
+serialize_shape(struct bytecode *code, FILE *outfile, uint16_t address)
+{
+        struct value_shape *shape = LIST_AT(&code->constants, address).shape;
+        fprintf(outfile, "%d %d %d", SHAPE_CONSTANT, shape->base, shape->rank);
+        for (int i = 0; i < shape->rank; i++)
+                fprintf(outfile, " %d", shape->dimensions[i]);
+        fprintf(outfile, "\n");
+}
+
 static uint16_t
 read_address(struct bytecode *code, int *ip)
 {
@@ -78,43 +92,95 @@ serialize_constants(struct bytecode *code, FILE *outfile)
                 case OP_LOCI_LONG:
                 case OP_LOCS_LONG:
                 case OP_LOCF_LONG:
+                        serialize_loc(code, outfile, op, read_address(code, &ip));
+                        break;
                 case OP_LOC_ALINK_LONG:
                         serialize_loc(code, outfile, op, read_address(code, &ip));
+                        ip += 1;
                         break;
                 case OP_SKIP_BACK_LONG:
                 case OP_SKIP_LONG:
                 case OP_SKIPF_LONG:
-                case OP_GET_INDEX:
-                case OP_EQUA:
-                case OP_ARGSTACK_LOAD:
+                case OP_SKIPF_POPV:
+                case OP_SKIPF_POP_LONG:
+                case OP_SKIP_NLT_LONG:
+                case OP_SKIP_NLEQ_LONG:
+                case OP_SKIP_NGRT_LONG:
+                case OP_SKIP_NGRTEQ_LONG:
+                case OP_SKIP_NEQ_LONG:
+                case OP_SKIP_EQ_LONG:
+                case OP_INC_LOCAL:
                         ip += 2;
                         break;
+                case OP_GET_INDEX:
+                case OP_REDUCE:
+                        serialize_shape(code, outfile, read_address(code, &ip));
+                        ip += 1;
+                        break;
+                case OP_UNPACK:
+                case OP_EQV:
+                case OP_SHIFT_ASTACKENT_TO_BASE:
+                case OP_ADDV:
+                case OP_SUBV:
+                case OP_MULV:
+                case OP_DIVV:
+                case OP_GRTV:
+                case OP_GRTEQV:
+                case OP_LTV:
+                case OP_LEQV:
+                        serialize_shape(code, outfile, read_address(code, &ip));
+                        break;
+                case OP_MATMUL:
+                        serialize_shape(code, outfile, read_address(code, &ip));
+                        serialize_shape(code, outfile, read_address(code, &ip));
+                        break;
+                case OP_CALL_DIRECT:
+                case OP_TAILCALL:
+                        ip += 3;
+                        break;
                 case OP_GET_LOCAL_LONG:
                 case OP_SET_LOCAL_LONG:
+                case OP_LEQ_LOCALS:
                         ip += 4;
                         break;
-                case OP_LT:
-                case OP_LEQ:
-                case OP_GRT:
-                case OP_GRTEQ:
                 case OP_PUSH_BYTE:
                 case OP_WRITE:
                 case OP_CALL:
                 case OP_RETURN:
                 case OP_READ:
-                case OP_ARGSTACK_UNLOAD:
+                case OP_ARGSTACK_LOAD:
+                case OP_ASTACK_RELEASE:
+                case OP_ASTACK_SHIFT_UP:
                         ip += 1;
                         break;
                 case OP_SET_INDEX_LOCAL_LONG:
+                        ip += 4;
+                        serialize_shape(code, outfile, read_address(code, &ip));
+                        ip += 1;
+                        break;
+                case OP_SKIP_NLEQ_LOCALS:
                         ip += 6;
                         break;
+                case OP_GET_ELEMENT_LOCAL_LONG:
+                case OP_SET_ELEMENT_LOCAL_LONG:
+                case OP_GET_ELEMENT_UNCHECKED_LONG:
+                case OP_SET_ELEMENT_UNCHECKED_LONG:
+                        ip += 7;
+                        break;
+                case OP_GET_ELEMENT2_LOCAL_LONG:
+                case OP_SET_ELEMENT2_LOCAL_LONG:
+                case OP_GET_ELEMENT2_UNCHECKED_LONG:
+                case OP_SET_ELEMENT2_UNCHECKED_LONG:
+                        ip += 9;
+                        break;
                 default:
                         break;
                 }
         }
 }
 
-static char *deserialize_constants(struct bytecode *code, char *p);
+static char *deserialize_module(struct bytecode *program, struct bytecode *code, char *p);
+static char *deserialize_constants(struct bytecode *program, struct bytecode *code, char *p);
 static char *deserialize_code(struct bytecode *code, char *p);
 static char *read_integer(char *p, int *i);
 static char *skip_spaces(char *p);
@@ -122,10 +188,19 @@ static void link_panic(char *fmt, ...);
 
 char *
 deserialize_bytecode(struct bytecode *code, char *p)
+{
+        p = deserialize_module(code, code, p);
+        compute_max_stack(code);
+        return p;
+}
+
+/* functions are put back in the function table of program */
+static char *
+deserialize_module(struct bytecode *program, struct bytecode *code, char *p)
 {
         bytecode_init(code);
         p = deserialize_code(code, p);
-        p = deserialize_constants(code, p);
+        p = deserialize_constants(program, code, p);
         return p;
 }
 
@@ -157,7 +232,7 @@ deserialize_code(struct bytecode *code, char *p)
 }
 
 static char *
-deserialize_constants(struct bytecode *code, char *p)
+deserialize_constants(struct bytecode *program, struct bytecode *code, char *p)
 {
         union value val;
         for (;;)
@@ -187,21 +262,49 @@ deserialize_constants(struct bytecode *code, char *p)
                                 }
                         }
                         buffer[len] = '\0';
-                        val.string.str = buffer;
-                        val.string.length = len;
-                        val.string.hash = hash_string(buffer, len);
+                        val.string = copy_string(buffer, len);
+                        free(buffer);
                         p++; /* skip \0 */
                         break;
                 }
                 case VAL_VECTOR:
-                        p = read_integer(p, &val.vector.size);
+                        p = read_integer(p, &val.integer); /* size of a vector literal */
                         break;
                 case VAL_FUNCTION: {
                         struct bytecode *subcode = malloc(sizeof(struct bytecode));
-                        p = deserialize_bytecode(subcode, p);
+                        int envindex, index;
+                        p = read_integer(p, &envindex);
+                        p = skip_spaces(p);
+                        p = read_integer(p, &index);
+                        p = skip_spaces(p);
+                        if (index < 0 || index >= MAX_CONSTANTS) {
+                                link_panic("invalid function index %d", index);
+                        }
+                        p = deserialize_module(program, subcode, p);
+                        subcode->envindex = envindex;
+                        subcode->index = index;
+                        while (LIST_LEN(&program->functions) <= index)
+                                codelist_push(&program->functions, NULL);
+                        LIST_AT(&program->functions, index) = subcode;
                         val.function.code = subcode;
                         break;
                 }
+                case SHAPE_CONSTANT: {
+                        int base, rank;
+                        int dimensions[MAX_VECTOR_DIMENSIONS];
+                        p = read_integer(p, &base);
+                        p = skip_spaces(p);
+                        p = read_integer(p, &rank);
+                        if (rank < 0 || rank > MAX_VECTOR_DIMENSIONS) {
+                                link_panic("invalid vector rank %d", rank);
+                        }
+                        for (int i = 0; i < rank; i++) {
+                                p = skip_spaces(p);
+                                p = read_integer(p, &dimensions[i]);
+                        }
+                        val.shape = shape_from_dimensions(dimensions, rank, base);
+                        break;
+                }
                 case END_FUNCTION_DELIM:
                         goto end;
                 default:
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+
+static int decode_instruction(struct bytecode *code, int ip, struct instruction *ins);
+static uint8_t read_byte(struct bytecode *code, int *ip);
+static uint16_t read_long(struct bytecode *code, int *ip);
+
+/*
+ * Turns the bytecode produced by the compiler (or read back by the
+ * deserializer) into an array of fixed width instructions whose operands
+ * are already decoded. Jump lengths become instruction counts relative to
+ * the instruction following the jump. Functions referenced by the code
+ * are decoded too.
+ */
+void
+decode_bytecode(struct bytecode *code)
+{
+        if (code == NULL || code->decoded != NULL)
+                return;
+
+        int len = LIST_LEN(&code->code);
+        struct instruction_stream *stream = malloc(sizeof(struct instruction_stream));
+        int *index_at = malloc(sizeof(int) * (len + 1));
+        int *targets = malloc(sizeof(int) * (len + 1));
+        stream->instructions = malloc(sizeof(struct instruction) * (len + 1));
+        stream->offsets = malloc(sizeof(int) * (len + 1));
+        stream->len = 0;
+        stream->translated = 0;
+        code->decoded = stream;
+
+        for (int ip = 0; ip < len; ) {
+                struct instruction *ins = stream->instructions + stream->len;
+                index_at[ip] = stream->len;
+                stream->offsets[stream->len] = ip;
+                targets[stream->len] = -1;
+                int next = decode_instruction(code, ip, ins);
+                switch (ins->op) {
+                case OP_SKIP_LONG:
+                case OP_SKIPF_LONG:
+                case OP_SKIPF_POPV:
+                case OP_SKIPF_POP_LONG:
+                case OP_SKIP_NLT_LONG:
+                case OP_SKIP_NLEQ_LONG:
+                case OP_SKIP_NGRT_LONG:
+                case OP_SKIP_NGRTEQ_LONG:
+                case OP_SKIP_NEQ_LONG:
+                case OP_SKIP_EQ_LONG:
+                case OP_SKIP_NLEQ_LOCALS:
+                        targets[stream->len] = next + ins->a;
+                        break;
+                case OP_SKIP_BACK_LONG:
+                        targets[stream->len] = next - ins->a;
+                        break;
+                case OP_LOCF_LONG:
+                        decode_bytecode(bytecode_constant_at(code, ins->a).function.code);
+                        break;
+                default:
+                        break;
+                }
+                stream->len++;
+                ip = next;
+        }
+        index_at[len] = stream->len;
+        stream->offsets[stream->len] = len > 0 ? len - 1 : 0;
+
+        for (int i = 0; i < stream->len; i++) {
+                if (targets[i] < 0)
+                        continue;
+                stream->instructions[i].a = index_at[targets[i]] - (i + 1);
+        }
+
+        free(index_at);
+        free(targets);
+}
+
+static int
+decode_instruction(struct bytecode *code, int ip, struct instruction *ins)
+{
+        ins->op = read_byte(code, &ip);
+        ins->a = ins->b = ins->c = 0;
+        ins->d = 0;
+        ins->e = 0;
+        switch (ins->op) {
+        case OP_LOCI_LONG:
+        case OP_LOCS_LONG:
+        case OP_LOCF_LONG:
+        case OP_SKIP_LONG:
+        case OP_SKIPF_LONG:
+        case OP_SKIP_BACK_LONG:
+        case OP_SKIPF_POPV:
+        case OP_SKIPF_POP_LONG:
+        case OP_SKIP_NLT_LONG:
+        case OP_SKIP_NLEQ_LONG:
+        case OP_SKIP_NGRT_LONG:
+        case OP_SKIP_NGRTEQ_LONG:
+        case OP_SKIP_NEQ_LONG:
+        case OP_SKIP_EQ_LONG:
+        case OP_INC_LOCAL:
+        case OP_EQV:
+        case OP_SHIFT_ASTACKENT_TO_BASE:
+        case OP_ADDV:
+        case OP_SUBV:
+        case OP_MULV:
+        case OP_DIVV:
+        case OP_GRTV:
+        case OP_GRTEQV:
+        case OP_LTV:
+        case OP_LEQV:
+                ins->a = read_long(code, &ip);
+                break;
+        case OP_SKIP_NLEQ_LOCALS:
+                ins->b = read_long(code, &ip);
+                ins->c = read_long(code, &ip);
+                ins->a = read_long(code, &ip);
+                break;
+        case OP_LOC_ALINK_LONG:
+                ins->a = bytecode_constant_at(code, read_long(code, &ip)).integer;
+                ins->b = read_byte(code, &ip);
+                break;
+        case OP_UNPACK:
+                ins->a = read_long(code, &ip);
+                ins->b = bytecode_constant_at(code, ins->a).shape->size;
+                break;
+        case OP_PUSH_BYTE:
+        case OP_WRITE:
+        case OP_READ:
+        case OP_CALL:
+        case OP_RETURN:
+        case OP_ARGSTACK_LOAD:
+        case OP_ASTACK_RELEASE:
+        case OP_ASTACK_SHIFT_UP:
+                ins->a = read_byte(code, &ip);
+                break;
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_LEQ_LOCALS:
+        case OP_MATMUL:
+                ins->a = read_long(code, &ip);
+                ins->b = read_long(code, &ip);
+                break;
+        case OP_CALL_DIRECT:
+        case OP_TAILCALL:
+        case OP_GET_INDEX:
+        case OP_REDUCE:
+                ins->a = read_long(code, &ip);
+                ins->b = read_byte(code, &ip);
+                break;
+        case OP_SET_INDEX_LOCAL_LONG:
+                ins->a = read_long(code, &ip);
+                ins->b = read_long(code, &ip);
+                ins->c = read_long(code, &ip);
+                ins->d = read_byte(code, &ip);
+                break;
+        case OP_GET_ELEMENT_LOCAL_LONG:
+        case OP_SET_ELEMENT_LOCAL_LONG:
+        case OP_GET_ELEMENT_UNCHECKED_LONG:
+        case OP_SET_ELEMENT_UNCHECKED_LONG:
+                ins->a = read_long(code, &ip);
+                ins->b = read_long(code, &ip);
+                ins->c = read_long(code, &ip);
+                ins->e = read_byte(code, &ip);
+                break;
+        case OP_GET_ELEMENT2_LOCAL_LONG:
+        case OP_SET_ELEMENT2_LOCAL_LONG:
+        case OP_GET_ELEMENT2_UNCHECKED_LONG:
+        case OP_SET_ELEMENT2_UNCHECKED_LONG:
+                ins->a = read_long(code, &ip);
+                ins->b = read_long(code, &ip);
+                ins->c = read_long(code, &ip);
+                ins->d = read_long(code, &ip);
+                ins->e = read_byte(code, &ip);
+                break;
+        case OP_ADDI:
+        case OP_SUBI:
+        case OP_MULI:
+        case OP_DIVI:
+        case OP_GRTI:
+        case OP_GRTEQI:
+        case OP_LTI:
+        case OP_LEQI:
+        case OP_GRTS:
+        case OP_GRTEQS:
+        case OP_LTS:
+        case OP_LEQS:
+        case OP_EQI:
+        case OP_EQB:
+        case OP_EQS:
+        case OP_NOT:
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EMPTY_STRING:
+        case OP_CONCAT:
+        case OP_SUBSTRING:
+        case OP_LENGTH:
+        case OP_POPV:
+        case OP_NEWLINE:
+        case OP_POPA:
+        case OP_ASTACK_MARK:
+        case OP_ARGSTACK_PEEK:
+        case OP_ARGSTACK_UNLOAD:
+        case OP_HALT:
+                break;
+        default:
+                fprintf(stderr, "linkage error: unknown opcode %d\n", ins->op);
+                exit(1);
+        }
+        return ip;
+}
+
+static uint8_t
+read_byte(struct bytecode *code, int *ip)
+{
+        return bytecode_byte_at(code, (*ip)++);
+}
+
+static uint16_t
+read_long(struct bytecode *code, int *ip)
+{
+        uint8_t left = read_byte(code, ip);
+        uint8_t right = read_byte(code, ip);
+        return join_bytes(left, right);
+}
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+
+#include "vm.h"
+
+/*
+ * Strings live in value.c until a collection frees the ones no root
+ * refers to, directly or through the slices and ropes built on them. The
+ * roots are the value stack up to the deepest slot the running frame can
+ * use, the array stack, the argument stack and the constants of every
+ * module. Slots carry no type, so every word of them is a candidate: a
+ * word is a root if it is the address of a string descriptor. A number
+ * that happens to look like one only keeps a string alive a little longer.
+ * The scan is conservative, not precise, and relies on every vector
+ * starting at a multiple of sizeof(union value) on the array stack, which
+ * pusha asserts. Packed integer and boolean vectors are rounded up to
+ * whole words for that reason.
+ *
+ * The vm collects before allocating a string once the number of strings
+ * has doubled since the last collection.
+ */
+
+static int stack_depth(struct stack_frame *frame);
+static void **add_roots(void **roots, union value *from, union value *to);
+
+void
+collect_strings(struct vm *vm)
+{
+        struct bytecode *program = vm->program;
+        union value *stacktop = vm->framese->stackbase + stack_depth(vm->framese);
+        union value *astacktop = (union value *) vm->framese->asp;
+        if (stacktop < vm->framese->sp)
+                stacktop = vm->framese->sp;
+        if (stacktop > vm->stackend)
+                stacktop = vm->stackend;
+
+        int count = (stacktop - vm->stack) + (astacktop - (union value *) vm->astack)
+                + (vm->argsp - vm->argstack) + LIST_LEN(&program->constants);
+        for (int i = 0; i < LIST_LEN(&program->functions); i++)
+                count += LIST_LEN(&LIST_AT(&program->functions, i)->constants);
+
+        void **roots = malloc(sizeof(void *) * (count + 1));
+        void **end = roots;
+        end = add_roots(end, vm->stack, stacktop);
+        end = add_roots(end, (union value *) vm->astack, astacktop);
+        end = add_roots(end, vm->argstack, vm->argsp);
+        end = add_roots(end, program->constants.buffer, program->constants.buffer + LIST_LEN(&program->constants));
+        for (int i = 0; i < LIST_LEN(&program->functions); i++) {
+                struct valuelist *constants = &LIST_AT(&program->functions, i)->constants;
+                end = add_roots(end, constants->buffer, constants->buffer + LIST_LEN(constants));
+        }
+        sweep_strings(roots, end - roots);
+        free(roots);
+
+        vm->string_threshold = 2 * string_count();
+        if (vm->string_threshold < GC_MIN_STRINGS)
+                vm->string_threshold = GC_MIN_STRINGS;
+}
+
+/* the register vm keeps its registers above the stack depth */
+static int
+stack_depth(struct stack_frame *frame)
+{
+        struct instruction *first = frame->code->decoded->instructions;
+        if (first->op == OP_REG_ENTER && first->a > frame->code->maxstack)
+                return first->a;
+        return frame->code->maxstack;
+}
+
+static void **
+add_roots(void **roots, union value *from, union value *to)
+{
+        for (union value *v = from; v < to; v++) {
+                if (v->string != NULL)
+                        *roots++ = v->string;
+        }
+        return roots;
+}
@@ -0,0 +1,586 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+
+/*
+ * Stack to register translation.
+ *
+ * Every value the stack machine pushes lives at a depth known at compile
+ * time, so stackbase[depth] can serve as a register, and locals already
+ * sit at stackbase[index]. The translator walks the decoded stack code
+ * with a virtual operand stack: loads of locals and small constants are
+ * recorded lazily and only written to a slot when needed, so that
+ * "x = x + 1" becomes a single OP_REG_ADDI x, x, 1.
+ *
+ * Instructions without a register form (calls, indexing, I/O, string and
+ * vector comparisons) are kept as
+ * they are. Register instructions do not move sp, so an OP_REG_SYNC is
+ * emitted in front of those whenever sp may be stale.
+ */
+
+enum entry_kind {
+        ENTRY_SLOT, /* value is in regs[slot] */
+        ENTRY_CONST, /* integer or boolean immediate */
+};
+
+struct entry {
+        enum entry_kind kind;
+        int slot;
+        int constant;
+};
+
+struct translator {
+        struct bytecode *code;
+        struct instruction_stream *in;
+        struct instruction_stream out;
+        int cap;
+
+        struct entry *entries; /* virtual operand stack */
+        int depth;
+        int maxdepth;
+        int spdepth; /* depth sp is known to reflect, -1 if unknown */
+        int lastdef; /* instruction that wrote the top temporary, -1 if none */
+
+        int *depth_at; /* depth recorded at each jump target */
+        int *new_index; /* first instruction emitted for each input instruction */
+        int *jump_target; /* input instruction targeted by each emitted jump */
+};
+
+static void translate(struct translator *tr);
+static int emit(struct translator *tr, int op, int a, int b, int c, int srcindex);
+static int operand(struct translator *tr, int pos, int srcindex);
+static void materialize(struct translator *tr, int pos, int srcindex);
+static void flush(struct translator *tr, int srcindex);
+static void reset_entries(struct translator *tr);
+static void push_slot(struct translator *tr, int slot);
+static void push_local(struct translator *tr, int slot, int srcindex);
+static void push_const(struct translator *tr, int constant);
+static void push_result(struct translator *tr);
+static void write_slot(struct translator *tr, int slot, int srcindex);
+static void translate_jump(struct translator *tr, struct instruction *ins, int srcindex);
+static int is_jump(int op);
+static int register_opcode(struct instruction *ins);
+static int stack_effect(struct instruction *ins);
+static int initial_depth(struct instruction_stream *stream);
+
+/*
+ * Replaces the decoded stream of code, and of the functions it
+ * references, with register code.
+ */
+void
+translate_to_registers(struct bytecode *code)
+{
+        if (code == NULL)
+                return;
+        decode_bytecode(code);
+        struct instruction_stream *in = code->decoded;
+        if (in->translated)
+                return;
+
+        for (int i = 0; i < in->len; i++) {
+                if (in->instructions[i].op == OP_LOCF_LONG)
+                        translate_to_registers(bytecode_constant_at(code, in->instructions[i].a).function.code);
+        }
+
+        struct translator tr;
+        tr.code = code;
+        tr.in = in;
+        tr.cap = in->len * 2 + 8;
+        tr.out.instructions = malloc(sizeof(struct instruction) * tr.cap);
+        tr.out.offsets = malloc(sizeof(int) * (tr.cap + 1));
+        tr.out.len = 0;
+        tr.out.translated = 1;
+        tr.entries = malloc(sizeof(struct entry) * (in->len + initial_depth(in) + 1));
+        tr.depth_at = malloc(sizeof(int) * (in->len + 1));
+        tr.new_index = malloc(sizeof(int) * (in->len + 1));
+        tr.jump_target = malloc(sizeof(int) * tr.cap);
+
+        translate(&tr);
+
+        free(in->instructions);
+        free(in->offsets);
+        *in = tr.out;
+        free(tr.entries);
+        free(tr.depth_at);
+        free(tr.new_index);
+        free(tr.jump_target);
+}
+
+static void
+translate(struct translator *tr)
+{
+        struct instruction_stream *in = tr->in;
+        char *is_target = calloc(in->len + 1, 1);
+        for (int i = 0; i < in->len; i++) {
+                tr->depth_at[i] = -1;
+                if (is_jump(in->instructions[i].op))
+                        is_target[i + 1 + in->instructions[i].a] = 1;
+        }
+
+        tr->depth = tr->maxdepth = tr->spdepth = initial_depth(in);
+        tr->lastdef = -1;
+        reset_entries(tr);
+
+        emit(tr, OP_REG_ENTER, 0, 0, 0, 0);
+
+        int unreachable = 0;
+        for (int i = 0; i < in->len; i++) {
+                struct instruction *ins = in->instructions + i;
+                if (is_target[i]) {
+                        if (unreachable && tr->depth_at[i] >= 0)
+                                tr->depth = tr->depth_at[i];
+                        else
+                                flush(tr, i);
+                        reset_entries(tr);
+                        tr->spdepth = -1;
+                }
+                unreachable = 0;
+                tr->new_index[i] = tr->out.len;
+
+                int op = register_opcode(ins);
+                int left = tr->depth - 2;
+                int right = tr->depth - 1;
+                switch (ins->op) {
+                case OP_PUSH_BYTE:
+                        push_const(tr, ins->a);
+                        break;
+                case OP_ZERO:
+                case OP_FALSE:
+                        push_const(tr, 0);
+                        break;
+                case OP_ONE:
+                case OP_TRUE:
+                        push_const(tr, 1);
+                        break;
+                case OP_LOCI_LONG:
+                        push_const(tr, bytecode_constant_at(tr->code, ins->a).integer);
+                        break;
+                case OP_LOCS_LONG:
+                case OP_LOCF_LONG:
+                        emit(tr, OP_REG_LOADK, tr->depth, ins->a, 0, i);
+                        push_result(tr);
+                        break;
+                case OP_GET_LOCAL_LONG:
+                        if (ins->a == 0) {
+                                push_local(tr, ins->b, i);
+                        } else {
+                                emit(tr, OP_REG_GET_OUTER, tr->depth, ins->a, ins->b, i);
+                                push_result(tr);
+                        }
+                        break;
+                case OP_SET_LOCAL_LONG:
+                        if (ins->a == 0) {
+                                write_slot(tr, ins->b, i);
+                        } else {
+                                emit(tr, OP_REG_SET_OUTER, operand(tr, right, i), ins->a, ins->b, i);
+                                tr->depth--;
+                        }
+                        break;
+                case OP_POPV:
+                        tr->depth--;
+                        tr->lastdef = -1;
+                        break;
+                case OP_LEQ_LOCALS:
+                        push_local(tr, ins->a, i);
+                        push_local(tr, ins->b, i);
+                        emit(tr, OP_REG_LEQ, tr->depth - 2, tr->entries[tr->depth - 2].slot, tr->entries[tr->depth - 1].slot, i);
+                        tr->depth -= 2;
+                        push_result(tr);
+                        break;
+                case OP_INC_LOCAL:
+                        push_local(tr, ins->a, i);
+                        emit(tr, OP_REG_ADDI, right + 1, ins->a, 1, i);
+                        tr->depth--;
+                        push_result(tr);
+                        write_slot(tr, ins->a, i);
+                        break;
+                case OP_NOT:
+                        emit(tr, OP_REG_NOT, right, operand(tr, right, i), 0, i);
+                        tr->depth--;
+                        push_result(tr);
+                        break;
+                case OP_ADDI:
+                case OP_SUBI:
+                        if (tr->entries[right].kind == ENTRY_CONST) {
+                                int constant = tr->entries[right].constant;
+                                emit(tr, OP_REG_ADDI, left, operand(tr, left, i), ins->op == OP_ADDI ? constant : -constant, i);
+                                tr->depth -= 2;
+                                push_result(tr);
+                                break;
+                        }
+                        /* fallthrough */
+                case OP_MULI:
+                case OP_DIVI:
+                case OP_GRTI:
+                case OP_GRTEQI:
+                case OP_LTI:
+                case OP_LEQI:
+                case OP_EQI:
+                case OP_EQB:
+                        emit(tr, op, left, operand(tr, left, i), operand(tr, right, i), i);
+                        tr->depth -= 2;
+                        push_result(tr);
+                        break;
+                default:
+                        if (is_jump(ins->op)) {
+                                translate_jump(tr, ins, i);
+                                unreachable = ins->op == OP_SKIP_LONG || ins->op == OP_SKIP_BACK_LONG;
+                                break;
+                        }
+                        flush(tr, i);
+                        if (tr->spdepth != tr->depth)
+                                emit(tr, OP_REG_SYNC, tr->depth, 0, 0, i);
+                        emit(tr, ins->op, ins->a, ins->b, ins->c, i);
+                        tr->out.instructions[tr->out.len - 1].d = ins->d;
+                        tr->out.instructions[tr->out.len - 1].e = ins->e;
+                        tr->depth += stack_effect(ins);
+                        tr->spdepth = tr->depth;
+                        tr->lastdef = -1;
+                        reset_entries(tr);
+                        unreachable = ins->op == OP_RETURN || ins->op == OP_TAILCALL || ins->op == OP_HALT;
+                        break;
+                }
+                if (tr->depth > tr->maxdepth)
+                        tr->maxdepth = tr->depth;
+        }
+        tr->new_index[in->len] = tr->out.len;
+        tr->out.offsets[tr->out.len] = in->offsets[in->len];
+
+        /* OP_REG_ENTER makes sure the registers fit in the stack */
+        tr->out.instructions[0].a = tr->maxdepth;
+        for (int i = 0; i < tr->out.len; i++) {
+                if (tr->jump_target[i] >= 0)
+                        tr->out.instructions[i].a = tr->new_index[tr->jump_target[i]] - (i + 1);
+        }
+        free(is_target);
+}
+
+static int
+emit(struct translator *tr, int op, int a, int b, int c, int srcindex)
+{
+        if (tr->out.len == tr->cap) {
+                tr->cap *= 2;
+                tr->out.instructions = realloc(tr->out.instructions, sizeof(struct instruction) * tr->cap);
+                tr->out.offsets = realloc(tr->out.offsets, sizeof(int) * (tr->cap + 1));
+                tr->jump_target = realloc(tr->jump_target, sizeof(int) * tr->cap);
+        }
+        struct instruction *ins = tr->out.instructions + tr->out.len;
+        ins->op = op;
+        ins->a = a;
+        ins->b = b;
+        ins->c = c;
+        ins->d = 0;
+        ins->e = 0;
+        tr->out.offsets[tr->out.len] = tr->in->offsets[srcindex];
+        tr->jump_target[tr->out.len] = -1;
+        return tr->out.len++;
+}
+
+/* returns the register holding the entry at pos, loading constants into regs[pos] */
+static int
+operand(struct translator *tr, int pos, int srcindex)
+{
+        if (tr->entries[pos].kind == ENTRY_CONST)
+                materialize(tr, pos, srcindex);
+        return tr->entries[pos].slot;
+}
+
+/* writes the entry at pos into regs[pos] */
+static void
+materialize(struct translator *tr, int pos, int srcindex)
+{
+        struct entry *e = tr->entries + pos;
+        if (e->kind == ENTRY_CONST)
+                emit(tr, OP_REG_LOADI, pos, e->constant, 0, srcindex);
+        else if (e->slot != pos)
+                emit(tr, OP_REG_MOVE, pos, e->slot, 0, srcindex);
+        else
+                return;
+        e->kind = ENTRY_SLOT;
+        e->slot = pos;
+        tr->lastdef = -1;
+}
+
+static void
+flush(struct translator *tr, int srcindex)
+{
+        for (int i = 0; i < tr->depth; i++)
+                materialize(tr, i, srcindex);
+}
+
+static void
+reset_entries(struct translator *tr)
+{
+        for (int i = 0; i < tr->depth; i++) {
+                tr->entries[i].kind = ENTRY_SLOT;
+                tr->entries[i].slot = i;
+        }
+}
+
+static void
+push_slot(struct translator *tr, int slot)
+{
+        struct entry *e = tr->entries + tr->depth++;
+        e->kind = ENTRY_SLOT;
+        e->slot = slot;
+        tr->lastdef = -1;
+}
+
+/* pushes local slot, whose own entry may still be lazy */
+static void
+push_local(struct translator *tr, int slot, int srcindex)
+{
+        if (slot < tr->depth)
+                materialize(tr, slot, srcindex);
+        push_slot(tr, slot);
+}
+
+static void
+push_const(struct translator *tr, int constant)
+{
+        struct entry *e = tr->entries + tr->depth++;
+        e->kind = ENTRY_CONST;
+        e->constant = constant;
+        tr->lastdef = -1;
+}
+
+/* pushes the value the last emitted instruction wrote to regs[depth] */
+static void
+push_result(struct translator *tr)
+{
+        push_slot(tr, tr->depth);
+        tr->lastdef = tr->out.len - 1;
+}
+
+/* pops the top entry into regs[slot] */
+static void
+write_slot(struct translator *tr, int slot, int srcindex)
+{
+        int top = tr->depth - 1;
+        int lastdef = tr->lastdef;
+
+        for (int i = 0; i < top; i++) {
+                if (tr->entries[i].kind == ENTRY_SLOT && tr->entries[i].slot == slot && i != slot) {
+                        materialize(tr, i, srcindex);
+                        lastdef = -1;
+                }
+        }
+
+        struct entry *e = tr->entries + top;
+        if (lastdef >= 0 && e->kind == ENTRY_SLOT && e->slot == top)
+                tr->out.instructions[lastdef].a = slot;
+        else if (e->kind == ENTRY_CONST)
+                emit(tr, OP_REG_LOADI, slot, e->constant, 0, srcindex);
+        else if (e->slot != slot)
+                emit(tr, OP_REG_MOVE, slot, e->slot, 0, srcindex);
+        tr->depth--;
+        tr->lastdef = -1;
+        if (slot < tr->depth) {
+                tr->entries[slot].kind = ENTRY_SLOT;
+                tr->entries[slot].slot = slot;
+        }
+}
+
+static void
+translate_jump(struct translator *tr, struct instruction *ins, int srcindex)
+{
+        int b = 0, c = 0, pops = 0;
+        switch (ins->op) {
+        case OP_SKIP_NLEQ_LOCALS:
+                push_local(tr, ins->b, srcindex);
+                push_local(tr, ins->c, srcindex);
+                /* fallthrough */
+        case OP_SKIP_NLT_LONG:
+        case OP_SKIP_NLEQ_LONG:
+        case OP_SKIP_NGRT_LONG:
+        case OP_SKIP_NGRTEQ_LONG:
+        case OP_SKIP_NEQ_LONG:
+        case OP_SKIP_EQ_LONG:
+                b = operand(tr, tr->depth - 2, srcindex);
+                c = operand(tr, tr->depth - 1, srcindex);
+                pops = 2;
+                break;
+        case OP_SKIPF_POP_LONG:
+                b = operand(tr, tr->depth - 1, srcindex);
+                pops = 1;
+                break;
+        case OP_SKIPF_LONG:
+        case OP_SKIPF_POPV:
+                b = tr->depth - 1;
+                break;
+        default:
+                break;
+        }
+        /* popped operands are read from their slots, which flush leaves alone */
+        tr->depth -= pops;
+        flush(tr, srcindex);
+        emit(tr, register_opcode(ins), 0, b, c, srcindex);
+        tr->jump_target[tr->out.len - 1] = srcindex + 1 + ins->a;
+        if (tr->depth_at[srcindex + 1 + ins->a] < 0)
+                tr->depth_at[srcindex + 1 + ins->a] = tr->depth;
+        if (ins->op == OP_SKIPF_POPV)
+                tr->depth--;
+}
+
+static int
+is_jump(int op)
+{
+        switch (op) {
+        case OP_SKIP_LONG:
+        case OP_SKIP_BACK_LONG:
+        case OP_SKIPF_LONG:
+        case OP_SKIPF_POPV:
+        case OP_SKIPF_POP_LONG:
+        case OP_SKIP_NLT_LONG:
+        case OP_SKIP_NLEQ_LONG:
+        case OP_SKIP_NGRT_LONG:
+        case OP_SKIP_NGRTEQ_LONG:
+        case OP_SKIP_NEQ_LONG:
+        case OP_SKIP_EQ_LONG:
+        case OP_SKIP_NLEQ_LOCALS:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+/* -1 if ins has no register form */
+static int
+register_opcode(struct instruction *ins)
+{
+        switch (ins->op) {
+        case OP_ADDI:
+                return OP_REG_ADD;
+        case OP_SUBI:
+                return OP_REG_SUB;
+        case OP_MULI:
+                return OP_REG_MUL;
+        case OP_DIVI:
+                return OP_REG_DIV;
+        case OP_GRTI:
+                return OP_REG_GRT;
+        case OP_GRTEQI:
+                return OP_REG_GRTEQ;
+        case OP_LTI:
+                return OP_REG_LT;
+        case OP_LEQI:
+                return OP_REG_LEQ;
+        case OP_EQI:
+        case OP_EQB:
+                return OP_REG_EQ;
+        case OP_SKIP_LONG:
+        case OP_SKIP_BACK_LONG:
+                return OP_REG_JUMP;
+        case OP_SKIPF_LONG:
+        case OP_SKIPF_POPV:
+        case OP_SKIPF_POP_LONG:
+                return OP_REG_JUMPF;
+        case OP_SKIP_NLT_LONG:
+                return OP_REG_JUMP_NLT;
+        case OP_SKIP_NLEQ_LONG:
+        case OP_SKIP_NLEQ_LOCALS:
+                return OP_REG_JUMP_NLEQ;
+        case OP_SKIP_NGRT_LONG:
+                return OP_REG_JUMP_NGRT;
+        case OP_SKIP_NGRTEQ_LONG:
+                return OP_REG_JUMP_NGRTEQ;
+        case OP_SKIP_NEQ_LONG:
+                return OP_REG_JUMP_NEQ;
+        case OP_SKIP_EQ_LONG:
+                return OP_REG_JUMP_EQ;
+        default:
+                return -1;
+        }
+}
+
+static int
+stack_effect(struct instruction *ins)
+{
+        switch (ins->op) {
+        case OP_LOCI_LONG:
+        case OP_LOCS_LONG:
+        case OP_LOCF_LONG:
+        case OP_PUSH_BYTE:
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EMPTY_STRING:
+        case OP_GET_LOCAL_LONG:
+        case OP_READ:
+        case OP_ARGSTACK_PEEK:
+        case OP_ASTACK_MARK:
+                return 1;
+        case OP_ADDI:
+        case OP_SUBI:
+        case OP_MULI:
+        case OP_DIVI:
+        case OP_GRTI:
+        case OP_GRTEQI:
+        case OP_LTI:
+        case OP_LEQI:
+        case OP_GRTS:
+        case OP_GRTEQS:
+        case OP_LTS:
+        case OP_LEQS:
+        case OP_EQI:
+        case OP_EQB:
+        case OP_EQS:
+        case OP_EQV:
+        case OP_ADDV:
+        case OP_SUBV:
+        case OP_MULV:
+        case OP_DIVV:
+        case OP_GRTV:
+        case OP_GRTEQV:
+        case OP_LTV:
+        case OP_LEQV:
+        case OP_CONCAT:
+        case OP_POPV:
+        case OP_SET_LOCAL_LONG:
+        case OP_POPA:
+        case OP_ASTACK_RELEASE:
+                return -1;
+        case OP_MATMUL:
+        case OP_SUBSTRING:
+                return -2;
+        case OP_WRITE:
+                return -4 * ins->a;
+        case OP_GET_INDEX:
+                return -ins->b;
+        case OP_SET_INDEX_LOCAL_LONG:
+                return -(ins->d + 1);
+        case OP_GET_ELEMENT2_LOCAL_LONG:
+        case OP_GET_ELEMENT2_UNCHECKED_LONG:
+                return -1;
+        case OP_SET_ELEMENT_LOCAL_LONG:
+        case OP_SET_ELEMENT_UNCHECKED_LONG:
+                return -2;
+        case OP_SET_ELEMENT2_LOCAL_LONG:
+        case OP_SET_ELEMENT2_UNCHECKED_LONG:
+                return -3;
+        case OP_CALL:
+                return -ins->a;
+        case OP_LOC_ALINK_LONG:
+                return 1 - ins->a;
+        case OP_UNPACK:
+                return ins->b - 1;
+        case OP_CALL_DIRECT:
+        case OP_TAILCALL:
+                return 1 - ins->b;
+        default:
+                return 0;
+        }
+}
+
+/* a function starts with its arguments on the stack; OP_RETURN carries its arity */
+static int
+initial_depth(struct instruction_stream *stream)
+{
+        for (int i = 0; i < stream->len; i++) {
+                if (stream->instructions[i].op == OP_RETURN)
+                        return stream->instructions[i].a;
+        }
+        return 0;
+}
@@ -0,0 +1,392 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "vm.h"
+
+/*
+ * Whole vector operations on integer vectors, reductions of integer and
+ * boolean vectors to a single value and the product of integer matrices.
+ * Every operation has a
+ * portable scalar kernel; on x86 processors supporting AVX2 the kernels
+ * below process eight elements at a time. The kernels are chosen once,
+ * when the vm is initialized.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECTOR_AVX2
+#include <immintrin.h>
+#endif
+
+/* the matrix product works on blocks of the right matrix that fit in the cache */
+#define MATMUL_BLOCK_ROWS 128
+#define MATMUL_BLOCK_COLUMNS 256
+
+static void matmul_blocked(int32_t *dst, int32_t *left, int32_t *right, int n, int m, int p,
+                void (*row)(int32_t *dst, int32_t *src, int32_t scale, int len));
+
+static void add_scalar(void *dst, int32_t *left, int32_t *right, int n);
+static void sub_scalar(void *dst, int32_t *left, int32_t *right, int n);
+static void mul_scalar(void *dst, int32_t *left, int32_t *right, int n);
+static void grt_scalar(void *dst, int32_t *left, int32_t *right, int n);
+static void grteq_scalar(void *dst, int32_t *left, int32_t *right, int n);
+static void lt_scalar(void *dst, int32_t *left, int32_t *right, int n);
+static void leq_scalar(void *dst, int32_t *left, int32_t *right, int n);
+static int sum_scalar(int32_t *v, int n);
+static int min_scalar(int32_t *v, int n);
+static int max_scalar(int32_t *v, int n);
+static int count_scalar(uint8_t *v, int n);
+static void matmul_scalar(int32_t *dst, int32_t *left, int32_t *right, int n, int m, int p);
+static void row_scalar(int32_t *dst, int32_t *src, int32_t scale, int len);
+
+static struct vector_kernels scalar_kernels = {
+        add_scalar,
+        sub_scalar,
+        mul_scalar,
+        grt_scalar,
+        grteq_scalar,
+        lt_scalar,
+        leq_scalar,
+        sum_scalar,
+        min_scalar,
+        max_scalar,
+        count_scalar,
+        matmul_scalar,
+};
+
+#ifdef VECTOR_AVX2
+static void add_avx2(void *dst, int32_t *left, int32_t *right, int n);
+static void sub_avx2(void *dst, int32_t *left, int32_t *right, int n);
+static void mul_avx2(void *dst, int32_t *left, int32_t *right, int n);
+static void grt_avx2(void *dst, int32_t *left, int32_t *right, int n);
+static void grteq_avx2(void *dst, int32_t *left, int32_t *right, int n);
+static void lt_avx2(void *dst, int32_t *left, int32_t *right, int n);
+static void leq_avx2(void *dst, int32_t *left, int32_t *right, int n);
+static int sum_avx2(int32_t *v, int n);
+static int min_avx2(int32_t *v, int n);
+static int max_avx2(int32_t *v, int n);
+static int count_avx2(uint8_t *v, int n);
+static void matmul_avx2(int32_t *dst, int32_t *left, int32_t *right, int n, int m, int p);
+static void row_avx2(int32_t *dst, int32_t *src, int32_t scale, int len);
+
+static struct vector_kernels avx2_kernels = {
+        add_avx2,
+        sub_avx2,
+        mul_avx2,
+        grt_avx2,
+        grteq_avx2,
+        lt_avx2,
+        leq_avx2,
+        sum_avx2,
+        min_avx2,
+        max_avx2,
+        count_avx2,
+        matmul_avx2,
+};
+#endif
+
+struct vector_kernels *
+select_vector_kernels(void)
+{
+#ifdef VECTOR_AVX2
+        if (__builtin_cpu_supports("avx2"))
+                return &avx2_kernels;
+#endif
+        return &scalar_kernels;
+}
+
+static void
+add_scalar(void *dst, int32_t *left, int32_t *right, int n)
+{
+        for (int i = 0; i < n; i++)
+                ((int32_t *) dst)[i] = left[i] + right[i];
+}
+
+static void
+sub_scalar(void *dst, int32_t *left, int32_t *right, int n)
+{
+        for (int i = 0; i < n; i++)
+                ((int32_t *) dst)[i] = left[i] - right[i];
+}
+
+static void
+mul_scalar(void *dst, int32_t *left, int32_t *right, int n)
+{
+        for (int i = 0; i < n; i++)
+                ((int32_t *) dst)[i] = left[i] * right[i];
+}
+
+static void
+grt_scalar(void *dst, int32_t *left, int32_t *right, int n)
+{
+        for (int i = 0; i < n; i++)
+                ((uint8_t *) dst)[i] = left[i] > right[i];
+}
+
+static void
+grteq_scalar(void *dst, int32_t *left, int32_t *right, int n)
+{
+        for (int i = 0; i < n; i++)
+                ((uint8_t *) dst)[i] = left[i] >= right[i];
+}
+
+static void
+lt_scalar(void *dst, int32_t *left, int32_t *right, int n)
+{
+        for (int i = 0; i < n; i++)
+                ((uint8_t *) dst)[i] = left[i] < right[i];
+}
+
+static void
+leq_scalar(void *dst, int32_t *left, int32_t *right, int n)
+{
+        for (int i = 0; i < n; i++)
+                ((uint8_t *) dst)[i] = left[i] <= right[i];
+}
+
+/* the sum wraps around like the scalar additions of the vm */
+static int
+sum_scalar(int32_t *v, int n)
+{
+        uint32_t sum = 0;
+        for (int i = 0; i < n; i++)
+                sum += (uint32_t) v[i];
+        return (int32_t) sum;
+}
+
+static int
+min_scalar(int32_t *v, int n)
+{
+        int32_t min = v[0];
+        for (int i = 1; i < n; i++)
+                min = v[i] < min ? v[i] : min;
+        return min;
+}
+
+static int
+max_scalar(int32_t *v, int n)
+{
+        int32_t max = v[0];
+        for (int i = 1; i < n; i++)
+                max = v[i] > max ? v[i] : max;
+        return max;
+}
+
+static int
+count_scalar(uint8_t *v, int n)
+{
+        int count = 0;
+        for (int i = 0; i < n; i++)
+                count += v[i];
+        return count;
+}
+
+/*
+ * Every row of the result is built adding rows of the right matrix scaled
+ * by an element of the left one, so that the innermost loop runs over
+ * contiguous memory. A block of the right matrix is used for all the rows
+ * of the left one before moving to the next.
+ */
+static void
+matmul_blocked(int32_t *dst, int32_t *left, int32_t *right, int n, int m, int p,
+                void (*row)(int32_t *dst, int32_t *src, int32_t scale, int len))
+{
+        memset(dst, 0, sizeof(int32_t) * n * p);
+        for (int kk = 0; kk < m; kk += MATMUL_BLOCK_ROWS) {
+                int kend = kk + MATMUL_BLOCK_ROWS < m ? kk + MATMUL_BLOCK_ROWS : m;
+                for (int jj = 0; jj < p; jj += MATMUL_BLOCK_COLUMNS) {
+                        int len = jj + MATMUL_BLOCK_COLUMNS < p ? MATMUL_BLOCK_COLUMNS : p - jj;
+                        for (int i = 0; i < n; i++) {
+                                for (int k = kk; k < kend; k++)
+                                        row(dst + i * p + jj, right + k * p + jj, left[i * m + k], len);
+                        }
+                }
+        }
+}
+
+static void
+matmul_scalar(int32_t *dst, int32_t *left, int32_t *right, int n, int m, int p)
+{
+        matmul_blocked(dst, left, right, n, m, p, row_scalar);
+}
+
+static void
+row_scalar(int32_t *dst, int32_t *src, int32_t scale, int len)
+{
+        for (int j = 0; j < len; j++)
+                dst[j] += scale * src[j];
+}
+
+#ifdef VECTOR_AVX2
+
+#define LOAD8(p) _mm256_loadu_si256((__m256i *) (p))
+#define STORE8(p, x) _mm256_storeu_si256((__m256i *) (p), (x))
+
+/* the elements left over after the last full block go through the scalar kernels */
+
+__attribute__((target("avx2")))
+static void
+add_avx2(void *dst, int32_t *left, int32_t *right, int n)
+{
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                STORE8((int32_t *) dst + i, _mm256_add_epi32(LOAD8(left + i), LOAD8(right + i)));
+        add_scalar((int32_t *) dst + i, left + i, right + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+sub_avx2(void *dst, int32_t *left, int32_t *right, int n)
+{
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                STORE8((int32_t *) dst + i, _mm256_sub_epi32(LOAD8(left + i), LOAD8(right + i)));
+        sub_scalar((int32_t *) dst + i, left + i, right + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+mul_avx2(void *dst, int32_t *left, int32_t *right, int n)
+{
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                STORE8((int32_t *) dst + i, _mm256_mullo_epi32(LOAD8(left + i), LOAD8(right + i)));
+        mul_scalar((int32_t *) dst + i, left + i, right + i, n - i);
+}
+
+/* one bit per element of the comparison mask, expanded to one boolean per byte */
+__attribute__((target("avx2")))
+static void
+store_mask(uint8_t *dst, __m256i mask, int negate)
+{
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+        for (int j = 0; j < 8; j++)
+                dst[j] = ((bits >> j) & 1) ^ negate;
+}
+
+__attribute__((target("avx2")))
+static void
+grt_avx2(void *dst, int32_t *left, int32_t *right, int n)
+{
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                store_mask((uint8_t *) dst + i, _mm256_cmpgt_epi32(LOAD8(left + i), LOAD8(right + i)), 0);
+        grt_scalar((uint8_t *) dst + i, left + i, right + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+grteq_avx2(void *dst, int32_t *left, int32_t *right, int n)
+{
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                store_mask((uint8_t *) dst + i, _mm256_cmpgt_epi32(LOAD8(right + i), LOAD8(left + i)), 1);
+        grteq_scalar((uint8_t *) dst + i, left + i, right + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+lt_avx2(void *dst, int32_t *left, int32_t *right, int n)
+{
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                store_mask((uint8_t *) dst + i, _mm256_cmpgt_epi32(LOAD8(right + i), LOAD8(left + i)), 0);
+        lt_scalar((uint8_t *) dst + i, left + i, right + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+leq_avx2(void *dst, int32_t *left, int32_t *right, int n)
+{
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                store_mask((uint8_t *) dst + i, _mm256_cmpgt_epi32(LOAD8(left + i), LOAD8(right + i)), 1);
+        leq_scalar((uint8_t *) dst + i, left + i, right + i, n - i);
+}
+
+/* the eight lanes are folded into one with the same operation */
+#define FOLD8(x, op) do { \
+        x = op(x, _mm256_permute2x128_si256(x, x, 1)); \
+        x = op(x, _mm256_shuffle_epi32(x, 0x4e)); \
+        x = op(x, _mm256_shuffle_epi32(x, 0xb1)); \
+} while (0)
+
+__attribute__((target("avx2")))
+static int
+sum_avx2(int32_t *v, int n)
+{
+        if (n < 8)
+                return sum_scalar(v, n);
+        __m256i acc = _mm256_setzero_si256();
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+                acc = _mm256_add_epi32(acc, LOAD8(v + i));
+        FOLD8(acc, _mm256_add_epi32);
+        return (int32_t) ((uint32_t) _mm256_cvtsi256_si32(acc) + (uint32_t) sum_scalar(v + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static int
+min_avx2(int32_t *v, int n)
+{
+        if (n < 8)
+                return min_scalar(v, n);
+        __m256i acc = LOAD8(v);
+        int i = 8;
+        for (; i + 8 <= n; i += 8)
+                acc = _mm256_min_epi32(acc, LOAD8(v + i));
+        FOLD8(acc, _mm256_min_epi32);
+        int min = _mm256_cvtsi256_si32(acc);
+        for (; i < n; i++)
+                min = v[i] < min ? v[i] : min;
+        return min;
+}
+
+__attribute__((target("avx2")))
+static int
+max_avx2(int32_t *v, int n)
+{
+        if (n < 8)
+                return max_scalar(v, n);
+        __m256i acc = LOAD8(v);
+        int i = 8;
+        for (; i + 8 <= n; i += 8)
+                acc = _mm256_max_epi32(acc, LOAD8(v + i));
+        FOLD8(acc, _mm256_max_epi32);
+        int max = _mm256_cvtsi256_si32(acc);
+        for (; i < n; i++)
+                max = v[i] > max ? v[i] : max;
+        return max;
+}
+
+/* booleans are bytes holding 0 or 1, summed 32 at a time */
+__attribute__((target("avx2")))
+static int
+count_avx2(uint8_t *v, int n)
+{
+        __m256i acc = _mm256_setzero_si256();
+        int i = 0;
+        for (; i + 32 <= n; i += 32)
+                acc = _mm256_add_epi64(acc, _mm256_sad_epu8(LOAD8(v + i), _mm256_setzero_si256()));
+        int64_t lanes[4];
+        STORE8(lanes, acc);
+        return (int) (lanes[0] + lanes[1] + lanes[2] + lanes[3]) + count_scalar(v + i, n - i);
+}
+
+static void
+matmul_avx2(int32_t *dst, int32_t *left, int32_t *right, int n, int m, int p)
+{
+        matmul_blocked(dst, left, right, n, m, p, row_avx2);
+}
+
+__attribute__((target("avx2")))
+static void
+row_avx2(int32_t *dst, int32_t *src, int32_t scale, int len)
+{
+        __m256i factor = _mm256_set1_epi32(scale);
+        int j = 0;
+        for (; j + 8 <= len; j += 8)
+                STORE8(dst + j, _mm256_add_epi32(LOAD8(dst + j), _mm256_mullo_epi32(factor, LOAD8(src + j))));
+        row_scalar(dst + j, src + j, scale, len - j);
+}
+
+#endif
@@ -1,18 +1,42 @@
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "vm.h"
 
+static void *map_stack(size_t size, void **end);
+static void unmap_stack(void *start, void *end);
+static int in_guard_page(void *addr, void *end);
+static void overflow_handler(int sig, siginfo_t *info, void *context);
+static int execute(struct vm *vm);
+
+static struct vm *running_vm;
+static struct vm *handler_vm; /* the last vm whose vm_init installed overflow_handler */
+static sigjmp_buf overflow_jump;
+
 static void
 runtime_error(struct vm *vm, char *fmt, ...)
 {
         vm->error = 1;
         va_list args;
         va_start(args, fmt);
-        struct lineinfo linfo = LIST_AT(&vm->framese->fn.code->lines, vm->framese->ip);
+        /* the saved ip is past the failing instruction */
+        struct instruction_stream *stream = vm->framese->code->decoded;
+        int index = vm->framese->ip - stream->instructions;
+        int offset = stream->offsets[index > 0 ? index - 1 : 0];
+        struct lineinfo linfo = LIST_AT(&vm->framese->code->lines, offset);
+        /* the error comes after what the program printed so far */
+        fflush(stdout);
         fprintf(stderr, "runtime error ");
         fprintf(stderr, "[at %d:%d]: ", linfo.line, linfo.linepos);
         vfprintf(stderr, fmt, args);
@@ -21,56 +45,125 @@ runtime_error(struct vm *vm, char *fmt, ...)
 }
 
 void
-vm_init(struct vm *vm, struct bytecode *code)
+vm_init(struct vm *vm, struct bytecode *code, enum vm_backend backend, int stack_size, int call_depth)
 {
+        vm->stack = map_stack(sizeof(union value) * stack_size, (void **) &vm->stackend);
+        vm->astack = map_stack(sizeof(union value) * stack_size, (void **) &vm->astackend);
+        vm->framestack = map_stack(sizeof(struct stack_frame) * call_depth, (void **) &vm->framestackend);
         vm->framese = vm->framestack;
         vm->argsp = vm->argstack;
-        vm->argasp = vm->astack + STACK_MAX;
-        struct value_function fn;
-        fn.code = code;
-        fn.envindex = 0;
-        stack_frame_init(vm->framese, vm->stack, vm->stack, vm->astack, fn);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = overflow_handler;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        vm->old_segv = malloc(sizeof(struct sigaction));
+        sigaction(SIGSEGV, &sa, vm->old_segv);
+        handler_vm = vm;
+
+        vm->program = code;
+        vm->functions = code->functions.buffer;
+        vm->string_threshold = GC_MIN_STRINGS;
+        vm->line = NULL;
+        vm->linecap = 0;
+        vm->kernels = select_vector_kernels();
+        if (backend == VM_REGISTER)
+                translate_to_registers(code);
+        else
+                decode_bytecode(code);
+        stack_frame_init(vm->framese, vm->stack, vm->stack, vm->astack, code);
         vm->error = 0;
 }
 
 void
-stack_frame_init(struct stack_frame *sf, union value *sp, union value *stackbase, union value *asp, struct value_function fn)
+vm_free(struct vm *vm)
+{
+        unmap_stack(vm->stack, vm->stackend);
+        unmap_stack(vm->astack, vm->astackend);
+        unmap_stack(vm->framestack, vm->framestackend);
+        free(vm->line);
+        /* vms are expected to be freed in the reverse order of vm_init */
+        sigaction(SIGSEGV, vm->old_segv, NULL);
+        free(vm->old_segv);
+        if (handler_vm == vm)
+                handler_vm = NULL;
+}
+
+/*
+ * Stacks are reserved, not allocated: pages are committed by the kernel the
+ * first time they are touched. The page past the end is left inaccessible,
+ * so pushing one value too many faults instead of being checked by every
+ * push. The value stack is also checked on calls against the depth the
+ * compiler computed for the callee; operations that move a stack pointer by
+ * more than one slot check against the end.
+ */
+static void *
+map_stack(size_t size, void **end)
+{
+        size_t page = sysconf(_SC_PAGESIZE);
+        size = (size + page - 1) / page * page;
+        char *start = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (start == MAP_FAILED || mprotect(start + size, page, PROT_NONE) != 0) {
+                perror("cannot allocate vm stack");
+                exit(1);
+        }
+        *end = start + size;
+        return start;
+}
+
+static void
+unmap_stack(void *start, void *end)
+{
+        munmap(start, (char *) end - (char *) start + sysconf(_SC_PAGESIZE));
+}
+
+static int
+in_guard_page(void *addr, void *end)
+{
+        return (char *) addr >= (char *) end && (char *) addr < (char *) end + sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Faults outside the guard pages are not ours: the action vm_init replaced
+ * is put back and the faulting instruction runs again under it.
+ */
+static void
+overflow_handler(int sig, siginfo_t *info, void *context)
+{
+        (void) sig;
+        (void) context;
+        struct vm *vm = running_vm;
+        if (vm != NULL && (in_guard_page(info->si_addr, vm->stackend) || in_guard_page(info->si_addr, vm->astackend)
+                                || in_guard_page(info->si_addr, vm->framestackend)))
+                siglongjmp(overflow_jump, 1);
+        if (handler_vm != NULL)
+                sigaction(SIGSEGV, handler_vm->old_segv, NULL);
+        else
+                signal(SIGSEGV, SIG_DFL);
+}
+
+void
+stack_frame_init(struct stack_frame *sf, union value *sp, union value *stackbase, char *asp, struct bytecode *code)
 {
-        sf->ip = 0;
+        sf->ip = code->decoded->instructions;
         sf->sp = sp;
         sf->stackbase = stackbase;
         sf->asp = asp;
-        sf->fn = fn;
+        sf->code = code;
 }
 
 #define VM_SP(vm) (vm->framese->sp)
 #define VM_STACKBASE(vm) (vm->framese->stackbase)
 #define VM_ASP(vm) (vm->framese->asp)
-#define VM_CODE(vm) (vm->framese->fn.code)
-#define VM_ENVINDEX(vm) (vm->framese->fn.envindex)
+#define VM_CODE(vm) (vm->framese->code)
+#define VM_ENVINDEX(vm) (VM_CODE(vm)->envindex)
 #define VM_IP(vm) (vm->framese->ip)
-
-static uint8_t
-advance_ip(struct vm *vm)
-{
-        return bytecode_byte_at(VM_CODE(vm), VM_IP(vm)++);
-}
-
-static uint16_t
-advance_long_ip(struct vm *vm)
-{
-        uint8_t left = advance_ip(vm);
-        uint8_t right = advance_ip(vm);
-        return join_bytes(left, right);
-}
+#define VM_FRAME_AT(vm, offset) (((offset) == 0 ? vm->framese : vm->framestack + VM_ENVINDEX(vm))[-(offset)])
 
 static void
 pushv(struct vm *vm, union value val)
 {
-        if (VM_SP(vm) - (vm->stack + STACK_MAX) >= 0) {
-                runtime_error(vm, "stack overflow");
-                return;
-        }
         *(VM_SP(vm)++) = val;
 }
 
@@ -86,44 +179,60 @@ peekv(struct vm *vm, int offset)
         return *(VM_SP(vm) - offset);
 }
 
-static void
-pusha(struct vm *vm, union value val)
+/*
+ * Reserves the storage of a vector of size elements on the array stack. A
+ * vector can be larger than the guard page, so the end is checked here and
+ * an overflow is reported like a fault in the guard page, see vm_run. The
+ * caller saves the ip first.
+ */
+static union value
+pusha(struct vm *vm, int size, enum value_type base)
 {
-        if (VM_ASP(vm) - (vm->astack + STACK_MAX) >= 0) {
-                runtime_error(vm, "stack overflow");
-                return;
-        }
-        *(VM_ASP(vm)++) = val;
+        union value vec;
+        if (VM_ASP(vm) + vector_storage_size(size, base) - vm->astackend > 0)
+                siglongjmp(overflow_jump, 1);
+        /* the collector only looks for strings at aligned words */
+        assert((VM_ASP(vm) - vm->astack) % sizeof(union value) == 0);
+        vec.vector.astackent = VM_ASP(vm);
+        VM_ASP(vm) += vector_storage_size(size, base);
+        return vec;
 }
 
+/* strings made while running may start a collection, see gc.c */
 static void
-asp_move_up(struct vm *vm, int offset)
+before_new_string(struct vm *vm)
 {
-        if ((VM_ASP(vm) + offset) - (vm->astack + STACK_MAX) > 0) {
-                runtime_error(vm, "stack overflow");
-                return;
-        }
-        VM_ASP(vm) += offset;
+        if (string_count() >= vm->string_threshold)
+                collect_strings(vm);
 }
 
-static void
-popa(struct vm *vm, int size) {
-        for (int i = 0; i < size; i++) {
-                VM_ASP(vm)--;
-        }
+static union value
+new_string(struct vm *vm, char *str, int length)
+{
+        if (length > SHORT_STRING_MAX)
+                before_new_string(vm);
+        union value v;
+        v.string = copy_runtime_string(str, length);
+        return v;
 }
 
-/* removes trailing new line */
+/* lines can be of any length, the trailing new line is removed */
 static int
-mgetline(char *buff, int cap)
+mgetline(struct vm *vm)
 {
-        char c;
-        char *p = buff;
-        while (p - buff < cap - 1 && (c = getchar()) != EOF && c != '\n') {
-                *p++ = c;
+        ssize_t len = getline(&vm->line, &vm->linecap, stdin);
+        if (len < 0) {
+                /* the end of the input reads as an empty line */
+                len = 0;
+                if (vm->line == NULL) {
+                        vm->linecap = 1;
+                        vm->line = malloc(vm->linecap);
+                }
         }
-        *p = '\0';
-        return p - buff;
+        if (len > 0 && vm->line[len - 1] == '\n')
+                len--;
+        vm->line[len] = '\0';
+        return len;
 }
 
 static int
@@ -149,19 +258,19 @@ atob(char *s)
 }
 
 static void
-dispatch_op_read(struct vm *vm, enum value_type vt, char *buffer, int cap)
+dispatch_op_read(struct vm *vm, enum value_type vt)
 {
-        mgetline(buffer, cap);
+        int len = mgetline(vm);
 
         switch (vt) {
                 case VAL_BOOLEAN:
-                        pushv(vm, value_from_c_bool(atob(buffer)));
+                        pushv(vm, value_from_c_bool(atob(vm->line)));
                         break;
                 case VAL_INTEGER:
-                        pushv(vm, value_from_c_int(atoi(buffer)));
+                        pushv(vm, value_from_c_int(atoi(vm->line)));
                         break;
                 case VAL_STRING:
-                        pushv(vm, value_from_c_string(buffer));
+                        pushv(vm, new_string(vm, vm->line, len));
                         break;
                 default:
                         exit(100);
@@ -169,348 +278,916 @@ dispatch_op_read(struct vm *vm, enum value_type vt, char *buffer, int cap)
         }
 }
 
-static int *
-read_from_stack_to_int_buffer(struct vm *vm, int *buffer, int len)
-{
-        int *bufferp = buffer + len - 1;
-        for (int i = 0; i < len; i++) {
-                *bufferp = popv(vm).integer;
-                bufferp--;
-        }
-        return bufferp;
-}
-
+/* pops the indices, returns the offset of the element they select or -1 */
 static int
-is_out_of_bounds(struct vm *vm, int *indicesbuff, int *dimensionsbuff, int len)
+pop_flat_index(struct vm *vm, struct value_shape *shape, int nindices)
 {
-        for (int i = 0; i < len; i++) {
-                if (indicesbuff[i] >= dimensionsbuff[i] || indicesbuff[i] < 0) {
-                        runtime_error(vm, "index out of bound (max index %d)", dimensionsbuff[i] - 1);
-                        return 1;
+        union value *indices = VM_SP(vm) - nindices;
+        int flat = 0;
+        for (int i = 0; i < nindices; i++) {
+                int index = indices[i].integer;
+                if (index >= shape->dimensions[i] || index < 0) {
+                        runtime_error(vm, "index out of bound (max index %d)", shape->dimensions[i] - 1);
+                        return -1;
                 }
+                flat += index * shape->strides[i];
         }
-        return 0;
+        VM_SP(vm) = indices;
+        return flat;
 }
 
-static void
-load_indexing_prelude(struct vm *vm, int *indicesbuff, int nindices, int *dimensionsbuff, int rank)
-{
-                read_from_stack_to_int_buffer(vm, dimensionsbuff, rank);
-                read_from_stack_to_int_buffer(vm, indicesbuff, nindices);
-}
+static int element_out_of_bounds(struct vm *vm, int dimension);
+static void vector_init(struct vm *vm, union value vec, int size, enum value_type base);
+static void vector_operation(struct vm *vm, void (*kernel)(void *, int32_t *, int32_t *, int), int size, enum value_type base);
+static int vector_divide(struct vm *vm, int size);
+static union value reduce(struct vm *vm, enum reduction kind, int size);
+static void matmul(struct vm *vm, struct value_shape *left, struct value_shape *right);
+static int subvector_size(struct value_shape *shape, int nindices);
+static void set_index_local_long(struct vm *vm, uint16_t offset, uint16_t index, struct value_shape *shape, uint8_t nindices);
+static void get_index(struct vm *vm, struct value_shape *shape, uint8_t nindices);
+
+/*
+ * Dispatch. With GCC-compatible compilers every handler jumps straight to
+ * the next one through a table of label addresses (threaded code). Building
+ * with -DVM_SWITCH_DISPATCH falls back to a portable switch loop.
+ */
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define CASE(op) do_##op:
+#define DISPATCH() goto *dispatch_table[(current = ip++)->op]
+#else
+#define CASE(op) case op:
+#define DISPATCH() goto dispatch
+#endif
+
+#define ARG(x) (current->x)
 
-static void get_local_long(struct vm *vm);
-static void set_local_long(struct vm *vm);
-static void set_index_local_long(struct vm *vm, int *indicesbuff, int *dimensionsbuff);
-static void get_index(struct vm *vm, int *indicesbuff, int *dimensionsbuff);
+#define SAVE_IP() (VM_IP(vm) = ip)
+#define LOAD_FRAME() (ip = VM_IP(vm), constants = VM_CODE(vm)->constants.buffer, regs = VM_STACKBASE(vm))
+
+#define PUSHV(val) (*(VM_SP(vm)++) = (val))
 
 int
 vm_run(struct vm *vm)
 {
-        char readbuff[OP_READ_BUF_CAP];
+        int res;
+        if (vm->error)
+                return vm->error;
+        running_vm = vm;
+        if (sigsetjmp(overflow_jump, 1)) {
+                /* a push hit a guard page, the last saved ip is reported */
+                runtime_error(vm, "stack overflow");
+                res = vm->error;
+        } else {
+                res = execute(vm);
+        }
+        running_vm = NULL;
+        return res;
+}
+
+/* label addresses and computed gotos are GNU extensions */
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static int
+execute(struct vm *vm)
+{
+#ifdef VM_COMPUTED_GOTO
+        static void *dispatch_table[] = {
+                [OP_LOCI_LONG] = &&do_OP_LOCI_LONG,
+                [OP_LOCS_LONG] = &&do_OP_LOCS_LONG,
+                [OP_LOCF_LONG] = &&do_OP_LOCF_LONG,
+                [OP_LOC_ALINK_LONG] = &&do_OP_LOC_ALINK_LONG,
+                [OP_UNPACK] = &&do_OP_UNPACK,
+                [OP_PUSH_BYTE] = &&do_OP_PUSH_BYTE,
+                [OP_ADDI] = &&do_OP_ADDI,
+                [OP_SUBI] = &&do_OP_SUBI,
+                [OP_MULI] = &&do_OP_MULI,
+                [OP_DIVI] = &&do_OP_DIVI,
+                [OP_ADDV] = &&do_OP_ADDV,
+                [OP_SUBV] = &&do_OP_SUBV,
+                [OP_MULV] = &&do_OP_MULV,
+                [OP_DIVV] = &&do_OP_DIVV,
+                [OP_GRTV] = &&do_OP_GRTV,
+                [OP_GRTEQV] = &&do_OP_GRTEQV,
+                [OP_LTV] = &&do_OP_LTV,
+                [OP_LEQV] = &&do_OP_LEQV,
+                [OP_REDUCE] = &&do_OP_REDUCE,
+                [OP_MATMUL] = &&do_OP_MATMUL,
+                [OP_CONCAT] = &&do_OP_CONCAT,
+                [OP_SUBSTRING] = &&do_OP_SUBSTRING,
+                [OP_LENGTH] = &&do_OP_LENGTH,
+                [OP_GRTI] = &&do_OP_GRTI,
+                [OP_GRTEQI] = &&do_OP_GRTEQI,
+                [OP_LTI] = &&do_OP_LTI,
+                [OP_LEQI] = &&do_OP_LEQI,
+                [OP_GRTS] = &&do_OP_GRTS,
+                [OP_GRTEQS] = &&do_OP_GRTEQS,
+                [OP_LTS] = &&do_OP_LTS,
+                [OP_LEQS] = &&do_OP_LEQS,
+                [OP_EQI] = &&do_OP_EQI,
+                [OP_EQB] = &&do_OP_EQB,
+                [OP_EQS] = &&do_OP_EQS,
+                [OP_EQV] = &&do_OP_EQV,
+                [OP_NOT] = &&do_OP_NOT,
+                [OP_SKIP_LONG] = &&do_OP_SKIP_LONG,
+                [OP_SKIPF_LONG] = &&do_OP_SKIPF_LONG,
+                [OP_SKIP_BACK_LONG] = &&do_OP_SKIP_BACK_LONG,
+                [OP_ZERO] = &&do_OP_ZERO,
+                [OP_ONE] = &&do_OP_ONE,
+                [OP_TRUE] = &&do_OP_TRUE,
+                [OP_FALSE] = &&do_OP_FALSE,
+                [OP_EMPTY_STRING] = &&do_OP_EMPTY_STRING,
+                [OP_POPV] = &&do_OP_POPV,
+                [OP_GET_LOCAL_LONG] = &&do_OP_GET_LOCAL_LONG,
+                [OP_SET_LOCAL_LONG] = &&do_OP_SET_LOCAL_LONG,
+                [OP_WRITE] = &&do_OP_WRITE,
+                [OP_NEWLINE] = &&do_OP_NEWLINE,
+                [OP_POPA] = &&do_OP_POPA,
+                [OP_ASTACK_SHIFT_UP] = &&do_OP_ASTACK_SHIFT_UP,
+                [OP_ASTACK_MARK] = &&do_OP_ASTACK_MARK,
+                [OP_ASTACK_RELEASE] = &&do_OP_ASTACK_RELEASE,
+                [OP_GET_INDEX] = &&do_OP_GET_INDEX,
+                [OP_SET_INDEX_LOCAL_LONG] = &&do_OP_SET_INDEX_LOCAL_LONG,
+                [OP_GET_ELEMENT_LOCAL_LONG] = &&do_OP_GET_ELEMENT_LOCAL_LONG,
+                [OP_GET_ELEMENT2_LOCAL_LONG] = &&do_OP_GET_ELEMENT2_LOCAL_LONG,
+                [OP_SET_ELEMENT_LOCAL_LONG] = &&do_OP_SET_ELEMENT_LOCAL_LONG,
+                [OP_SET_ELEMENT2_LOCAL_LONG] = &&do_OP_SET_ELEMENT2_LOCAL_LONG,
+                [OP_GET_ELEMENT_UNCHECKED_LONG] = &&do_OP_GET_ELEMENT_UNCHECKED_LONG,
+                [OP_GET_ELEMENT2_UNCHECKED_LONG] = &&do_OP_GET_ELEMENT2_UNCHECKED_LONG,
+                [OP_SET_ELEMENT_UNCHECKED_LONG] = &&do_OP_SET_ELEMENT_UNCHECKED_LONG,
+                [OP_SET_ELEMENT2_UNCHECKED_LONG] = &&do_OP_SET_ELEMENT2_UNCHECKED_LONG,
+                [OP_READ] = &&do_OP_READ,
+                [OP_CALL] = &&do_OP_CALL,
+                [OP_CALL_DIRECT] = &&do_OP_CALL_DIRECT,
+                [OP_TAILCALL] = &&do_OP_TAILCALL,
+                [OP_RETURN] = &&do_OP_RETURN,
+                [OP_SHIFT_ASTACKENT_TO_BASE] = &&do_OP_SHIFT_ASTACKENT_TO_BASE,
+                [OP_ARGSTACK_LOAD] = &&do_OP_ARGSTACK_LOAD,
+                [OP_ARGSTACK_PEEK] = &&do_OP_ARGSTACK_PEEK,
+                [OP_ARGSTACK_UNLOAD] = &&do_OP_ARGSTACK_UNLOAD,
+                [OP_LEQ_LOCALS] = &&do_OP_LEQ_LOCALS,
+                [OP_INC_LOCAL] = &&do_OP_INC_LOCAL,
+                [OP_SKIPF_POPV] = &&do_OP_SKIPF_POPV,
+                [OP_SKIPF_POP_LONG] = &&do_OP_SKIPF_POP_LONG,
+                [OP_SKIP_NLT_LONG] = &&do_OP_SKIP_NLT_LONG,
+                [OP_SKIP_NLEQ_LONG] = &&do_OP_SKIP_NLEQ_LONG,
+                [OP_SKIP_NGRT_LONG] = &&do_OP_SKIP_NGRT_LONG,
+                [OP_SKIP_NGRTEQ_LONG] = &&do_OP_SKIP_NGRTEQ_LONG,
+                [OP_SKIP_NEQ_LONG] = &&do_OP_SKIP_NEQ_LONG,
+                [OP_SKIP_EQ_LONG] = &&do_OP_SKIP_EQ_LONG,
+                [OP_SKIP_NLEQ_LOCALS] = &&do_OP_SKIP_NLEQ_LOCALS,
+                [OP_HALT] = &&do_OP_HALT,
+                [OP_REG_MOVE] = &&do_OP_REG_MOVE,
+                [OP_REG_LOADI] = &&do_OP_REG_LOADI,
+                [OP_REG_LOADK] = &&do_OP_REG_LOADK,
+                [OP_REG_GET_OUTER] = &&do_OP_REG_GET_OUTER,
+                [OP_REG_SET_OUTER] = &&do_OP_REG_SET_OUTER,
+                [OP_REG_ADD] = &&do_OP_REG_ADD,
+                [OP_REG_ADDI] = &&do_OP_REG_ADDI,
+                [OP_REG_SUB] = &&do_OP_REG_SUB,
+                [OP_REG_MUL] = &&do_OP_REG_MUL,
+                [OP_REG_DIV] = &&do_OP_REG_DIV,
+                [OP_REG_GRT] = &&do_OP_REG_GRT,
+                [OP_REG_GRTEQ] = &&do_OP_REG_GRTEQ,
+                [OP_REG_LT] = &&do_OP_REG_LT,
+                [OP_REG_LEQ] = &&do_OP_REG_LEQ,
+                [OP_REG_EQ] = &&do_OP_REG_EQ,
+                [OP_REG_NOT] = &&do_OP_REG_NOT,
+                [OP_REG_JUMP] = &&do_OP_REG_JUMP,
+                [OP_REG_JUMPF] = &&do_OP_REG_JUMPF,
+                [OP_REG_JUMP_NLT] = &&do_OP_REG_JUMP_NLT,
+                [OP_REG_JUMP_NLEQ] = &&do_OP_REG_JUMP_NLEQ,
+                [OP_REG_JUMP_NGRT] = &&do_OP_REG_JUMP_NGRT,
+                [OP_REG_JUMP_NGRTEQ] = &&do_OP_REG_JUMP_NGRTEQ,
+                [OP_REG_JUMP_NEQ] = &&do_OP_REG_JUMP_NEQ,
+                [OP_REG_JUMP_EQ] = &&do_OP_REG_JUMP_EQ,
+                [OP_REG_SYNC] = &&do_OP_REG_SYNC,
+                [OP_REG_ENTER] = &&do_OP_REG_ENTER,
+        };
+#endif
         union value val0;
         union value val1;
-        enum opcode current;
-        uint8_t arg0, arg1;
-        uint16_t arglong0;
+        struct instruction *ip, *current;
+        union value *constants;
+        union value *regs;
 
-        int indicesbuff[MAX_VECTOR_DIMENSIONS];
-        int dimensionsbuff[MAX_VECTOR_DIMENSIONS];
+        LOAD_FRAME();
 
-        for (;;) {
-        if (vm->error)
-                return vm->error;
-        current = advance_ip(vm);
-        switch (current) {
-        case OP_LOCI_LONG:
-        case OP_LOCS_LONG:
-        case OP_LOCF_LONG:
-                arglong0 = advance_long_ip(vm);
-                pushv(vm, bytecode_constant_at(VM_CODE(vm), arglong0));
-                break;
-        case OP_PUSH_BYTE:
-                val0 = value_from_c_int(advance_ip(vm));
-                pushv(vm, val0);
-                break;
-        case OP_ADDI:
+#ifdef VM_COMPUTED_GOTO
+        DISPATCH();
+#else
+dispatch:
+        switch ((current = ip++)->op) {
+#endif
+        CASE(OP_LOCI_LONG)
+        CASE(OP_LOCS_LONG)
+        CASE(OP_LOCF_LONG)
+                PUSHV(constants[ARG(a)]);
+                DISPATCH();
+        CASE(OP_PUSH_BYTE)
+                PUSHV(value_from_c_int(ARG(a)));
+                DISPATCH();
+        CASE(OP_ADDI)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_int(val0.integer + val1.integer));
-                break;
-        case OP_SUBI:
+                PUSHV(value_from_c_int(val0.integer + val1.integer));
+                DISPATCH();
+        CASE(OP_SUBI)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_int(val0.integer - val1.integer));
-                break;
-        case OP_MULI:
+                PUSHV(value_from_c_int(val0.integer - val1.integer));
+                DISPATCH();
+        CASE(OP_MULI)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_int(val0.integer * val1.integer));
-                break;
-        case OP_DIVI:
+                PUSHV(value_from_c_int(val0.integer * val1.integer));
+                DISPATCH();
+        CASE(OP_DIVI)
                 val1 = popv(vm);
                 val0 = popv(vm);
                 if (val1.integer == 0) {
+                        SAVE_IP();
+                        runtime_error(vm, "division by 0");
+                        return 0;
+                }
+                PUSHV(value_from_c_int(val0.integer / val1.integer));
+                DISPATCH();
+        /* a: shape of the operands */
+        CASE(OP_ADDV)
+                SAVE_IP();
+                vector_operation(vm, vm->kernels->add, constants[ARG(a)].shape->size, VAL_INTEGER);
+                DISPATCH();
+        CASE(OP_SUBV)
+                SAVE_IP();
+                vector_operation(vm, vm->kernels->sub, constants[ARG(a)].shape->size, VAL_INTEGER);
+                DISPATCH();
+        CASE(OP_MULV)
+                SAVE_IP();
+                vector_operation(vm, vm->kernels->mul, constants[ARG(a)].shape->size, VAL_INTEGER);
+                DISPATCH();
+        CASE(OP_DIVV)
+                SAVE_IP();
+                if (!vector_divide(vm, constants[ARG(a)].shape->size)) {
                         runtime_error(vm, "division by 0");
                         return 0;
                 }
-                pushv(vm, value_from_c_int(val0.integer / val1.integer));
-                break;
-        case OP_GRT:
-                arg0 = advance_ip(vm);
+                DISPATCH();
+        CASE(OP_GRTV)
+                SAVE_IP();
+                vector_operation(vm, vm->kernels->grt, constants[ARG(a)].shape->size, VAL_BOOLEAN);
+                DISPATCH();
+        CASE(OP_GRTEQV)
+                SAVE_IP();
+                vector_operation(vm, vm->kernels->grteq, constants[ARG(a)].shape->size, VAL_BOOLEAN);
+                DISPATCH();
+        CASE(OP_LTV)
+                SAVE_IP();
+                vector_operation(vm, vm->kernels->lt, constants[ARG(a)].shape->size, VAL_BOOLEAN);
+                DISPATCH();
+        CASE(OP_LEQV)
+                SAVE_IP();
+                vector_operation(vm, vm->kernels->leq, constants[ARG(a)].shape->size, VAL_BOOLEAN);
+                DISPATCH();
+        /* a: shape of the operand, b: enum reduction */
+        CASE(OP_REDUCE)
+                val0 = reduce(vm, ARG(b), constants[ARG(a)].shape->size);
+                PUSHV(val0);
+                DISPATCH();
+        /* a, b: shapes of the operands */
+        CASE(OP_MATMUL)
+                SAVE_IP();
+                matmul(vm, constants[ARG(a)].shape, constants[ARG(b)].shape);
+                DISPATCH();
+        /* the operands stay on the stack in case a collection starts */
+        CASE(OP_CONCAT)
+                val0 = VM_SP(vm)[-2];
+                val1 = VM_SP(vm)[-1];
+                if (string_length(val0.string) > INT_MAX - string_length(val1.string)) {
+                        SAVE_IP();
+                        runtime_error(vm, "string too long");
+                        return vm->error;
+                }
+                before_new_string(vm);
+                val0.string = concat_strings(val0.string, val1.string);
+                VM_SP(vm) -= 2;
+                PUSHV(val0);
+                DISPATCH();
+        /* the string, the start and the length of the substring */
+        CASE(OP_SUBSTRING)
+                val0 = VM_SP(vm)[-3];
+                val1 = VM_SP(vm)[-2];
+                if (val1.integer < 0 || VM_SP(vm)[-1].integer < 0
+                                || VM_SP(vm)[-1].integer > string_length(val0.string) - val1.integer) {
+                        SAVE_IP();
+                        runtime_error(vm, "substring out of bounds (length %d)", string_length(val0.string));
+                        return vm->error;
+                }
+                before_new_string(vm);
+                val0.string = slice_string(val0.string, val1.integer, VM_SP(vm)[-1].integer);
+                VM_SP(vm) -= 3;
+                PUSHV(val0);
+                DISPATCH();
+        CASE(OP_LENGTH)
+                VM_SP(vm)[-1] = value_from_c_int(string_length(VM_SP(vm)[-1].string));
+                DISPATCH();
+        CASE(OP_GRTI)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                PUSHV(value_from_c_bool(val0.integer > val1.integer));
+                DISPATCH();
+        CASE(OP_GRTEQI)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                PUSHV(value_from_c_bool(val0.integer >= val1.integer));
+                DISPATCH();
+        CASE(OP_LTI)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                PUSHV(value_from_c_bool(val0.integer < val1.integer));
+                DISPATCH();
+        CASE(OP_LEQI)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                PUSHV(value_from_c_bool(val0.integer <= val1.integer));
+                DISPATCH();
+        CASE(OP_GRTS)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                PUSHV(value_from_c_bool(compare_strings(val0.string, val1.string) > 0));
+                DISPATCH();
+        CASE(OP_GRTEQS)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_bool(compare_values(val0, val1, arg0) > 0));
-                break;
-        case OP_GRTEQ:
-                arg0 = advance_ip(vm);
+                PUSHV(value_from_c_bool(compare_strings(val0.string, val1.string) >= 0));
+                DISPATCH();
+        CASE(OP_LTS)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_bool(compare_values(val0, val1, arg0) >= 0));
-                break;
-        case OP_LT:
-                arg0 = advance_ip(vm);
+                PUSHV(value_from_c_bool(compare_strings(val0.string, val1.string) < 0));
+                DISPATCH();
+        CASE(OP_LEQS)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_bool(compare_values(val0, val1, arg0) < 0));
-                break;
-        case OP_LEQ:
-                arg0 = advance_ip(vm);
+                PUSHV(value_from_c_bool(compare_strings(val0.string, val1.string) <= 0));
+                DISPATCH();
+        CASE(OP_EQI)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_bool(compare_values(val0, val1, arg0) <= 0));
-                break;
-        case OP_EQUA:
-                arg0 = advance_ip(vm);
-                arg1 = advance_ip(vm);
+                PUSHV(value_from_c_bool(val0.integer == val1.integer));
+                DISPATCH();
+        CASE(OP_EQB)
                 val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_bool(values_equal(val0, val1, arg0, arg1)));
-                break;
-        case OP_NOT:
+                PUSHV(value_from_c_bool(val0.boolean == val1.boolean));
+                DISPATCH();
+        CASE(OP_EQS)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                PUSHV(value_from_c_bool(strings_equal(val0.string, val1.string)));
+                DISPATCH();
+        CASE(OP_EQV)
+                val1 = popv(vm);
                 val0 = popv(vm);
-                pushv(vm, value_from_c_bool(!val0.boolean));
-                break;
-        case OP_ZERO:
-                pushv(vm, value_from_c_int(0));
-                break;
-        case OP_ONE:
-                pushv(vm, value_from_c_int(1));
-                break;
-        case OP_FALSE:
-                pushv(vm, value_from_c_bool(0));
-                break;
-        case OP_TRUE:
-                pushv(vm, value_from_c_bool(1));
-                break;
-        case OP_EMPTY_STRING:
-                pushv(vm, value_from_c_string(""));
-                break;
-        case OP_SKIP_LONG:
-                arglong0 = advance_long_ip(vm);
-                VM_IP(vm) += arglong0;
-                break;
-        case OP_SKIP_BACK_LONG:
-                arglong0 = advance_long_ip(vm);
-                VM_IP(vm) -= arglong0;
-                break;
-        case OP_SKIPF_LONG:
-                arglong0 = advance_long_ip(vm);
+                PUSHV(value_from_c_bool(vectors_equal(val0, val1, constants[ARG(a)].shape->base, constants[ARG(a)].shape->size)));
+                DISPATCH();
+        CASE(OP_NOT)
+                val0 = popv(vm);
+                PUSHV(value_from_c_bool(!val0.boolean));
+                DISPATCH();
+        CASE(OP_ZERO)
+                PUSHV(value_from_c_int(0));
+                DISPATCH();
+        CASE(OP_ONE)
+                PUSHV(value_from_c_int(1));
+                DISPATCH();
+        CASE(OP_FALSE)
+                PUSHV(value_from_c_bool(0));
+                DISPATCH();
+        CASE(OP_TRUE)
+                PUSHV(value_from_c_bool(1));
+                DISPATCH();
+        CASE(OP_EMPTY_STRING)
+                val0 = new_string(vm, "", 0);
+                PUSHV(val0);
+                DISPATCH();
+        CASE(OP_SKIP_LONG)
+        CASE(OP_SKIP_BACK_LONG)
+                ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIPF_LONG)
                 val0 = peekv(vm, 1);
                 if (!val0.boolean) {
-                        VM_IP(vm) += arglong0;
+                        ip += ARG(a);
                 }
-                break;
-        case OP_POPV:
+                DISPATCH();
+        CASE(OP_SKIPF_POPV)
+                if (!peekv(vm, 1).boolean)
+                        ip += ARG(a);
+                else
+                        popv(vm);
+                DISPATCH();
+        CASE(OP_SKIPF_POP_LONG)
+                if (!popv(vm).boolean)
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIP_NLT_LONG)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                if (!(val0.integer < val1.integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIP_NLEQ_LONG)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                if (!(val0.integer <= val1.integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIP_NGRT_LONG)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                if (!(val0.integer > val1.integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIP_NGRTEQ_LONG)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                if (!(val0.integer >= val1.integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIP_NEQ_LONG)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                if (val0.integer != val1.integer)
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIP_EQ_LONG)
+                val1 = popv(vm);
+                val0 = popv(vm);
+                if (val0.integer == val1.integer)
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_SKIP_NLEQ_LOCALS)
+                if (!(regs[ARG(b)].integer <= regs[ARG(c)].integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_POPV)
                 popv(vm);
-                break;
-        case OP_POPA:
+                DISPATCH();
+        CASE(OP_POPA)
+                /* local vectors are freed in the reverse order of their declaration */
+                VM_ASP(vm) = popv(vm).vector.astackent;
+                DISPATCH();
+        CASE(OP_ASTACK_SHIFT_UP)
+                SAVE_IP();
                 val0 = popv(vm);
-                popa(vm, val0.vector.size);
-                break;
-        case OP_POP_TO_ASTACK:
+                val1 = pusha(vm, val0.integer, ARG(a));
+                vector_init(vm, val1, val0.integer, ARG(a));
+                PUSHV(val1);
+                DISPATCH();
+        CASE(OP_ASTACK_MARK)
+                val0.vector.astackent = VM_ASP(vm);
+                PUSHV(val0);
+                DISPATCH();
+        CASE(OP_ASTACK_RELEASE)
+                /* a: values pushed after the mark that are kept */
+                val0 = peekv(vm, ARG(a) + 1);
+                VM_ASP(vm) = val0.vector.astackent;
+                memmove(VM_SP(vm) - ARG(a) - 1, VM_SP(vm) - ARG(a), ARG(a) * sizeof(union value));
+                VM_SP(vm)--;
+                DISPATCH();
+        CASE(OP_LOC_ALINK_LONG)
+                /* a: size, b: base type, the elements are moved from the value stack */
+                SAVE_IP();
+                val0 = pusha(vm, ARG(a), ARG(b));
+                VM_SP(vm) -= ARG(a);
+                for (int i = 0; i < ARG(a); i++)
+                        vector_value_set_element_at(val0, i, VM_SP(vm)[i], ARG(b));
+                PUSHV(val0);
+                DISPATCH();
+        CASE(OP_UNPACK)
+                /* a: shape of the vector */
                 val0 = popv(vm);
-                pusha(vm, val0);
-                break;
-        case OP_ASTACK_SHIFT_UP:
-                asp_move_up(vm, popv(vm).integer);
-                break;
-        case OP_LOC_ALINK_LONG:
-                arglong0 = advance_long_ip(vm);
-                LIST_AT(&VM_CODE(vm)->constants, arglong0).vector.astackent = VM_ASP(vm) - bytecode_constant_at(VM_CODE(vm), arglong0).vector.size;
-                pushv(vm, bytecode_constant_at(VM_CODE(vm), arglong0));
-                break;
-        case OP_NEWLINE:
+                for (int i = 0; i < constants[ARG(a)].shape->size; i++)
+                        PUSHV(vector_value_get_element_at(val0, i, constants[ARG(a)].shape->base));
+                DISPATCH();
+        CASE(OP_NEWLINE)
                 printf("\n");
-                break;
-        case OP_WRITE: {
-                arg0 = advance_ip(vm);
-                for (union value *p = VM_SP(vm) - arg0 * 3; p < VM_SP(vm);) {
-                        union value val = *p++;
-                        enum value_type type = (p++)->integer;
-                        enum value_type base = (p++)->integer;
-                        value_print(val, type, base);
-                }
-                for (int i = 0; i < arg0; i++) {
-                        popv(vm);
-                        enum value_type type = popv(vm).integer;
-                        union value val = popv(vm);
-                        if (type == VAL_VECTOR)
-                                popa(vm, val.vector.size);
+                DISPATCH();
+        CASE(OP_WRITE)
+                for (union value *p = VM_SP(vm) - ARG(a) * 4; p < VM_SP(vm); p += 4) {
+                        if (p[1].integer == VAL_VECTOR)
+                                vector_print(p[0], p[2].integer, p[3].integer);
+                        else
+                                value_print(p[0], p[1].integer);
                 }
-                break;
-        }
-        case OP_READ:
-                arg0 = advance_ip(vm);
-                dispatch_op_read(vm, arg0, readbuff, OP_READ_BUF_CAP);
-                break;
-        case OP_CALL:
-                arg0 = advance_ip(vm); /* function arity */
-                val0 = peekv(vm, arg0 + 1);
-                stack_frame_init(vm->framese + 1, VM_SP(vm), VM_SP(vm) - arg0, VM_ASP(vm), val0.function);
+                VM_SP(vm) -= ARG(a) * 4;
+                DISPATCH();
+        CASE(OP_READ)
+                SAVE_IP();
+                dispatch_op_read(vm, ARG(a));
+                if (vm->error)
+                        return vm->error;
+                DISPATCH();
+        CASE(OP_CALL)
+                /* a: function arity, the function value below the arguments is dropped */
+                SAVE_IP();
+                val0 = peekv(vm, ARG(a) + 1);
+                if (VM_SP(vm) - ARG(a) - 1 + val0.function.code->maxstack - vm->stackend > 0)
+                        goto stack_overflow;
+                memmove(VM_SP(vm) - ARG(a) - 1, VM_SP(vm) - ARG(a), ARG(a) * sizeof(union value));
+                VM_SP(vm)--;
+                stack_frame_init(vm->framese + 1, VM_SP(vm), VM_SP(vm) - ARG(a), VM_ASP(vm), val0.function.code);
+                vm->framese++;
+                LOAD_FRAME();
+                DISPATCH();
+        CASE(OP_CALL_DIRECT)
+                /* a: function table index, b: function arity */
+                SAVE_IP();
+                if (VM_SP(vm) - ARG(b) + vm->functions[ARG(a)]->maxstack - vm->stackend > 0)
+                        goto stack_overflow;
+                stack_frame_init(vm->framese + 1, VM_SP(vm), VM_SP(vm) - ARG(b), VM_ASP(vm), vm->functions[ARG(a)]);
                 vm->framese++;
-                break;
-        case OP_SHIFT_ASTACKENT_TO_BASE:
+                LOAD_FRAME();
+                DISPATCH();
+        CASE(OP_TAILCALL)
+                /* the arguments of the callee take the place of the current ones */
+                if (VM_STACKBASE(vm) + vm->functions[ARG(a)]->maxstack - vm->stackend > 0)
+                        goto stack_overflow;
+                memmove(VM_STACKBASE(vm), VM_SP(vm) - ARG(b), ARG(b) * sizeof(union value));
+                VM_SP(vm) = VM_STACKBASE(vm) + ARG(b);
+                VM_ASP(vm) = vm->framese[-1].asp;
+                vm->framese[-1].sp = VM_SP(vm); /* OP_RETURN pops the callee arguments */
+                VM_CODE(vm) = vm->functions[ARG(a)];
+                VM_IP(vm) = VM_CODE(vm)->decoded->instructions;
+                LOAD_FRAME();
+                DISPATCH();
+        CASE(OP_SHIFT_ASTACKENT_TO_BASE)
+                /* a returned argument lies below the caller's vectors, copying it grows them */
+                SAVE_IP();
+                if (vm->framese[-1].asp + vector_storage_size(constants[ARG(a)].shape->size, constants[ARG(a)].shape->base) - vm->astackend > 0)
+                        goto stack_overflow;
                 val0 = peekv(vm, 1);
-                for (int i = 0; i < val0.vector.size; i++) {
-                       *(vm->framese[-1].asp + i) = *(val0.vector.astackent + i);
-                }
+                memmove(vm->framese[-1].asp, val0.vector.astackent, constants[ARG(a)].shape->size * vector_element_size(constants[ARG(a)].shape->base));
                 vm->framese->sp[-1].vector.astackent = vm->framese[-1].asp;
-                vm->framese[-1].asp += val0.vector.size;
-                break;
-        case OP_RETURN:
-                arg0 = advance_ip(vm); /* function arity */
+                vm->framese[-1].asp += vector_storage_size(constants[ARG(a)].shape->size, constants[ARG(a)].shape->base);
+                DISPATCH();
+        CASE(OP_RETURN)
                 val0 = popv(vm);
                 vm->framese--;
-                vm->framese->sp -= arg0 + 1;
-                pushv(vm, val0);
-                break;
-        case OP_ARGSTACK_LOAD:
-                arg0 = advance_ip(vm);
-                arg1 = advance_ip(vm);
-                val0 = VM_STACKBASE(vm)[arg0];
-                if (arg1) {
-                        vm->argasp -= val0.vector.size;
-                        memcpy(vm->argasp, val0.vector.astackent, val0.vector.size * sizeof(union value));
-                        val0.vector.astackent = vm->argasp;
+                vm->framese->sp -= ARG(a); /* a: function arity */
+                LOAD_FRAME();
+                PUSHV(val0);
+                DISPATCH();
+        CASE(OP_ARGSTACK_LOAD)
+                /* vectors stay in the storage the caller passed */
+                *vm->argsp++ = VM_STACKBASE(vm)[ARG(a)];
+                DISPATCH();
+        CASE(OP_ARGSTACK_PEEK)
+                PUSHV(*(vm->argsp - 1));
+                DISPATCH();
+        CASE(OP_ARGSTACK_UNLOAD)
+                vm->argsp--;
+                DISPATCH();
+        CASE(OP_GET_LOCAL_LONG)
+                PUSHV(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)]);
+                DISPATCH();
+        CASE(OP_SET_LOCAL_LONG)
+                VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)] = popv(vm);
+                DISPATCH();
+        CASE(OP_LEQ_LOCALS)
+                PUSHV(value_from_c_bool(regs[ARG(a)].integer <= regs[ARG(b)].integer));
+                DISPATCH();
+        CASE(OP_INC_LOCAL)
+                regs[ARG(a)] = value_from_c_int(regs[ARG(a)].integer + 1);
+                DISPATCH();
+        CASE(OP_SET_INDEX_LOCAL_LONG)
+                SAVE_IP();
+                set_index_local_long(vm, ARG(a), ARG(b), constants[ARG(c)].shape, ARG(d));
+                if (vm->error)
+                        return vm->error;
+                DISPATCH();
+        CASE(OP_GET_INDEX)
+                SAVE_IP();
+                get_index(vm, constants[ARG(a)].shape, ARG(b));
+                if (vm->error)
+                        return vm->error;
+                DISPATCH();
+        /* the unsigned comparisons also reject negative indices */
+        CASE(OP_GET_ELEMENT_LOCAL_LONG)
+                val0 = VM_SP(vm)[-1];
+                if ((unsigned) val0.integer >= (unsigned) ARG(c)) {
+                        SAVE_IP();
+                        return element_out_of_bounds(vm, ARG(c));
+                }
+                VM_SP(vm)[-1] = vector_value_get_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], val0.integer, ARG(e));
+                DISPATCH();
+        CASE(OP_GET_ELEMENT2_LOCAL_LONG)
+                val0 = VM_SP(vm)[-2];
+                val1 = VM_SP(vm)[-1];
+                if ((unsigned) val0.integer >= (unsigned) ARG(c)) {
+                        SAVE_IP();
+                        return element_out_of_bounds(vm, ARG(c));
+                }
+                if ((unsigned) val1.integer >= (unsigned) ARG(d)) {
+                        SAVE_IP();
+                        return element_out_of_bounds(vm, ARG(d));
                 }
-                *vm->argsp++ = val0;
-                break;
-        case OP_ARGSTACK_PEEK:
-                pushv(vm, *(vm->argsp - 1));
-                break;
-        case OP_ARGSTACK_UNLOAD:
-                arg0 = advance_ip(vm);
-                val0 = *--vm->argsp;
-                if (arg0) {
-                        vm->argasp += val0.vector.size;
+                VM_SP(vm)--;
+                VM_SP(vm)[-1] = vector_value_get_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], val0.integer * ARG(d) + val1.integer, ARG(e));
+                DISPATCH();
+        CASE(OP_SET_ELEMENT_LOCAL_LONG)
+                val0 = VM_SP(vm)[-1];
+                if ((unsigned) val0.integer >= (unsigned) ARG(c)) {
+                        SAVE_IP();
+                        return element_out_of_bounds(vm, ARG(c));
                 }
-                break;
-        case OP_GET_LOCAL_LONG:
-                get_local_long(vm);
-                break;
-        case OP_SET_LOCAL_LONG:
-                set_local_long(vm);
-                break;
-        case OP_SET_INDEX_LOCAL_LONG:
-                set_index_local_long(vm, indicesbuff, dimensionsbuff);
-                break;
-        case OP_GET_INDEX:
-                get_index(vm, indicesbuff, dimensionsbuff);
-                break;
-        case OP_HALT:
+                vector_value_set_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], val0.integer, VM_SP(vm)[-2], ARG(e));
+                VM_SP(vm) -= 2;
+                DISPATCH();
+        CASE(OP_SET_ELEMENT2_LOCAL_LONG)
+                val0 = VM_SP(vm)[-2];
+                val1 = VM_SP(vm)[-1];
+                if ((unsigned) val0.integer >= (unsigned) ARG(c)) {
+                        SAVE_IP();
+                        return element_out_of_bounds(vm, ARG(c));
+                }
+                if ((unsigned) val1.integer >= (unsigned) ARG(d)) {
+                        SAVE_IP();
+                        return element_out_of_bounds(vm, ARG(d));
+                }
+                vector_value_set_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], val0.integer * ARG(d) + val1.integer, VM_SP(vm)[-3], ARG(e));
+                VM_SP(vm) -= 3;
+                DISPATCH();
+        CASE(OP_GET_ELEMENT_UNCHECKED_LONG)
+                VM_SP(vm)[-1] = vector_value_get_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], VM_SP(vm)[-1].integer, ARG(e));
+                DISPATCH();
+        CASE(OP_GET_ELEMENT2_UNCHECKED_LONG)
+                VM_SP(vm)--;
+                VM_SP(vm)[-1] = vector_value_get_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], VM_SP(vm)[-1].integer * ARG(d) + VM_SP(vm)[0].integer, ARG(e));
+                DISPATCH();
+        CASE(OP_SET_ELEMENT_UNCHECKED_LONG)
+                vector_value_set_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], VM_SP(vm)[-1].integer, VM_SP(vm)[-2], ARG(e));
+                VM_SP(vm) -= 2;
+                DISPATCH();
+        CASE(OP_SET_ELEMENT2_UNCHECKED_LONG)
+                vector_value_set_element_at(VM_FRAME_AT(vm, ARG(a)).stackbase[ARG(b)], VM_SP(vm)[-2].integer * ARG(d) + VM_SP(vm)[-1].integer, VM_SP(vm)[-3], ARG(e));
+                VM_SP(vm) -= 3;
+                DISPATCH();
+        CASE(OP_HALT)
                 return 0;
+        CASE(OP_REG_MOVE)
+                regs[ARG(a)] = regs[ARG(b)];
+                DISPATCH();
+        CASE(OP_REG_LOADI)
+                regs[ARG(a)] = value_from_c_int(ARG(b));
+                DISPATCH();
+        CASE(OP_REG_LOADK)
+                regs[ARG(a)] = constants[ARG(b)];
+                DISPATCH();
+        CASE(OP_REG_GET_OUTER)
+                regs[ARG(a)] = VM_FRAME_AT(vm, ARG(b)).stackbase[ARG(c)];
+                DISPATCH();
+        CASE(OP_REG_SET_OUTER)
+                VM_FRAME_AT(vm, ARG(b)).stackbase[ARG(c)] = regs[ARG(a)];
+                DISPATCH();
+        CASE(OP_REG_ADD)
+                regs[ARG(a)] = value_from_c_int(regs[ARG(b)].integer + regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_ADDI)
+                regs[ARG(a)] = value_from_c_int(regs[ARG(b)].integer + ARG(c));
+                DISPATCH();
+        CASE(OP_REG_SUB)
+                regs[ARG(a)] = value_from_c_int(regs[ARG(b)].integer - regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_MUL)
+                regs[ARG(a)] = value_from_c_int(regs[ARG(b)].integer * regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_DIV)
+                if (regs[ARG(c)].integer == 0) {
+                        SAVE_IP();
+                        runtime_error(vm, "division by 0");
+                        return 0;
+                }
+                regs[ARG(a)] = value_from_c_int(regs[ARG(b)].integer / regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_GRT)
+                regs[ARG(a)] = value_from_c_bool(regs[ARG(b)].integer > regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_GRTEQ)
+                regs[ARG(a)] = value_from_c_bool(regs[ARG(b)].integer >= regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_LT)
+                regs[ARG(a)] = value_from_c_bool(regs[ARG(b)].integer < regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_LEQ)
+                regs[ARG(a)] = value_from_c_bool(regs[ARG(b)].integer <= regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_EQ)
+                regs[ARG(a)] = value_from_c_bool(regs[ARG(b)].integer == regs[ARG(c)].integer);
+                DISPATCH();
+        CASE(OP_REG_NOT)
+                regs[ARG(a)] = value_from_c_bool(!regs[ARG(b)].boolean);
+                DISPATCH();
+        CASE(OP_REG_JUMP)
+                ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_JUMPF)
+                if (!regs[ARG(b)].boolean)
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_JUMP_NLT)
+                if (!(regs[ARG(b)].integer < regs[ARG(c)].integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_JUMP_NLEQ)
+                if (!(regs[ARG(b)].integer <= regs[ARG(c)].integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_JUMP_NGRT)
+                if (!(regs[ARG(b)].integer > regs[ARG(c)].integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_JUMP_NGRTEQ)
+                if (!(regs[ARG(b)].integer >= regs[ARG(c)].integer))
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_JUMP_NEQ)
+                if (regs[ARG(b)].integer != regs[ARG(c)].integer)
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_JUMP_EQ)
+                if (regs[ARG(b)].integer == regs[ARG(c)].integer)
+                        ip += ARG(a);
+                DISPATCH();
+        CASE(OP_REG_SYNC)
+                VM_SP(vm) = regs + ARG(a);
+                DISPATCH();
+        CASE(OP_REG_ENTER)
+                if (regs + ARG(a) - vm->stackend > 0)
+                        goto stack_overflow;
+                DISPATCH();
+#ifndef VM_COMPUTED_GOTO
         default:
-                runtime_error(vm, "NOT IMPLEMENTED: %s\n", opcodestring(current));
+                SAVE_IP();
+                runtime_error(vm, "NOT IMPLEMENTED: %s\n", opcodestring(ARG(op)));
                 return 1;
         }
-        }
-}
+#endif
 
-static void
-get_local_long(struct vm *vm)
-{
-        uint16_t offset = advance_long_ip(vm);
-        uint16_t index = advance_long_ip(vm);
-        struct stack_frame *fp = offset == 0 ? vm->framese : vm->framestack + VM_ENVINDEX(vm);
-        pushv(vm, fp[-offset].stackbase[index]);
+stack_overflow:
+        SAVE_IP();
+        runtime_error(vm, "stack overflow");
+        return vm->error;
 }
 
-static void
-set_local_long(struct vm *vm)
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+static int
+element_out_of_bounds(struct vm *vm, int dimension)
 {
-        uint16_t offset = advance_long_ip(vm);
-        uint16_t index = advance_long_ip(vm);
-        struct stack_frame *fp = offset == 0 ? vm->framese : vm->framestack + VM_ENVINDEX(vm);
-        fp[-offset].stackbase[index] = popv(vm);
+        runtime_error(vm, "index out of bound (max index %d)", dimension - 1);
+        runtime_error(vm, "index out of bounds");
+        return vm->error;
 }
 
 static void
-set_index_local_long(struct vm *vm, int *indicesbuff, int *dimensionsbuff)
+set_index_local_long(struct vm *vm, uint16_t offset, uint16_t index, struct value_shape *shape, uint8_t nindices)
 {
-        uint16_t offset = advance_long_ip(vm);
-        uint16_t index = advance_long_ip(vm);
-        uint8_t nindices = advance_ip(vm);
-        uint8_t rank = advance_ip(vm);
-        struct stack_frame *fp = offset == 0 ? vm->framese : vm->framestack + VM_ENVINDEX(vm);
-        union value val0 = fp[-offset].stackbase[index];
-
-        load_indexing_prelude(vm, indicesbuff, nindices, dimensionsbuff, rank);
+        union value val0 = VM_FRAME_AT(vm, offset).stackbase[index];
 
-        if (is_out_of_bounds(vm, indicesbuff, dimensionsbuff, nindices)) {
+        int start = pop_flat_index(vm, shape, nindices);
+        if (start < 0) {
                 runtime_error(vm, "index out of bounds");
                 return;
         }
 
         union value val1 = popv(vm);
-        if (nindices == rank) {
-                val0.vector.astackent[index_flattened(dimensionsbuff, indicesbuff, nindices)] = val1;
-        }
-        else {
-                for (int i = nindices; i < rank; i++) {
-                        indicesbuff[i] = 0;
-                }
-                int start = index_flattened(dimensionsbuff, indicesbuff, rank);
-                for (int i = 0; i < val1.vector.size; i++) {
-                        val0.vector.astackent[start + i] = val1.vector.astackent[i];
-                }
-        }
+        if (nindices == shape->rank)
+                vector_value_set_element_at(val0, start, val1, shape->base);
+        else
+                memmove(vector_element_address(val0, start, shape->base), val1.vector.astackent, subvector_size(shape, nindices) * vector_element_size(shape->base));
 }
 
 static void
-get_index(struct vm *vm, int *indicesbuff, int *dimensionsbuff)
+get_index(struct vm *vm, struct value_shape *shape, uint8_t nindices)
 {
-        uint8_t nindices = advance_ip(vm);
-        uint8_t rank = advance_ip(vm);
-
-        load_indexing_prelude(vm, indicesbuff, nindices, dimensionsbuff, rank);
-
-        union value val0 = popv(vm);
-
-        if (is_out_of_bounds(vm, indicesbuff, dimensionsbuff, nindices)) {
+        int start = pop_flat_index(vm, shape, nindices);
+        if (start < 0) {
                 runtime_error(vm, "index out of bounds");
                 return;
         }
 
-        if (nindices == rank) {
-                union value from_main_vector = val0.vector.astackent[index_flattened(dimensionsbuff, indicesbuff, nindices)];
-                pushv(vm, from_main_vector);
+        union value val0 = popv(vm);
+
+        if (nindices == shape->rank) {
+                pushv(vm, vector_value_get_element_at(val0, start, shape->base));
+        } else if (nindices == 0) {
+                /* a copy, owned by the caller */
+                union value result_value = pusha(vm, shape->size, shape->base);
+                memcpy(result_value.vector.astackent, val0.vector.astackent, shape->size * vector_element_size(shape->base));
+                pushv(vm, result_value);
         } else {
-                for (int i = nindices; i < rank; i++) {
-                        indicesbuff[i] = 0;
-                }
-                int start = index_flattened(dimensionsbuff, indicesbuff, rank);
-                int count = 1;
-                for (int i = nindices; i < rank; i++) {
-                        count *= dimensionsbuff[i];
-                }
-                for (int i = 0; i < count; i++) {
-                        union value from_main_vector = val0.vector.astackent[start + i];
-                        pusha(vm, from_main_vector);
-                }
+                /* the elements of a subvector are contiguous, it is read in place */
                 union value result_value;
-                result_value.vector.size = count;
-                result_value.vector.astackent = VM_ASP(vm) - count;
+                result_value.vector.astackent = vector_element_address(val0, start, shape->base);
                 pushv(vm, result_value);
         }
 }
+
+/* elements selected by the first nindices indices */
+static int
+subvector_size(struct value_shape *shape, int nindices)
+{
+        return nindices == 0 ? shape->size : shape->strides[nindices - 1];
+}
+
+/* default vectors hold zeros, falses or empty strings */
+static void
+vector_init(struct vm *vm, union value vec, int size, enum value_type base)
+{
+        memset(vec.vector.astackent, 0, size * vector_element_size(base));
+        if (base == VAL_STRING) {
+                union value empty = new_string(vm, "", 0);
+                for (int i = 0; i < size; i++)
+                        vector_value_set_element_at(vec, i, empty, base);
+        }
+}
+
+/* pops two integer vectors, pushes the vector of base type computed by kernel */
+static void
+vector_operation(struct vm *vm, void (*kernel)(void *, int32_t *, int32_t *, int), int size, enum value_type base)
+{
+        union value right = popv(vm);
+        union value left = popv(vm);
+        union value result = pusha(vm, size, base);
+        kernel(result.vector.astackent, left.vector.astackent, right.vector.astackent, size);
+        pushv(vm, result);
+}
+
+/* integer division has no vector instructions, it is checked and done here */
+static int
+vector_divide(struct vm *vm, int size)
+{
+        int32_t *right = peekv(vm, 1).vector.astackent;
+        int32_t *left = peekv(vm, 2).vector.astackent;
+        for (int i = 0; i < size; i++) {
+                if (right[i] == 0)
+                        return 0;
+        }
+        VM_SP(vm) -= 2;
+        union value result = pusha(vm, size, VAL_INTEGER);
+        for (int i = 0; i < size; i++)
+                ((int32_t *) result.vector.astackent)[i] = left[i] / right[i];
+        pushv(vm, result);
+        return 1;
+}
+
+static union value
+reduce(struct vm *vm, enum reduction kind, int size)
+{
+        void *elements = popv(vm).vector.astackent;
+        switch (kind) {
+        case REDUCE_SUM:
+                return value_from_c_int(vm->kernels->sum(elements, size));
+        case REDUCE_MIN:
+                return value_from_c_int(vm->kernels->min(elements, size));
+        case REDUCE_MAX:
+                return value_from_c_int(vm->kernels->max(elements, size));
+        case REDUCE_COUNT:
+                return value_from_c_int(vm->kernels->count(elements, size));
+        case REDUCE_ANY:
+                return value_from_c_bool(memchr(elements, 1, size) != NULL);
+        case REDUCE_ALL:
+                return value_from_c_bool(memchr(elements, 0, size) == NULL);
+        }
+        return value_from_c_int(0);
+}
+
+/* pops the operands and the destination, which may be one of them */
+static void
+matmul(struct vm *vm, struct value_shape *left, struct value_shape *right)
+{
+        int32_t *dst = popv(vm).vector.astackent;
+        int32_t *b = popv(vm).vector.astackent;
+        int32_t *a = popv(vm).vector.astackent;
+        int n = left->dimensions[0];
+        int m = left->dimensions[1];
+        int p = right->dimensions[1];
+        int32_t *res = dst;
+        char *asp = VM_ASP(vm);
+        if ((dst < a + n * m && a < dst + n * p) || (dst < b + m * p && b < dst + n * p))
+                res = pusha(vm, n * p, VAL_INTEGER).vector.astackent;
+        vm->kernels->matmul(res, a, b, n, m, p);
+        if (res != dst)
+                memcpy(dst, res, sizeof(int32_t) * n * p);
+        VM_ASP(vm) = asp;
+        pushv(vm, value_void());
+}
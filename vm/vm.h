@@ -5,30 +5,113 @@
 
 #include "../semantics/semantics.h"
 
-#define STACK_MAX (1 << 16)
-#define OP_READ_BUF_CAP (1 << 10)
+#define DEFAULT_STACK_SIZE (1 << 16)
+#define DEFAULT_CALL_DEPTH (1 << 16)
+#define GC_MIN_STRINGS (1 << 12) /* strings allocated before the first collection */
+
+struct instruction {
+        int a;
+        int b;
+        int c;
+        uint16_t d;
+        uint8_t op;
+        uint8_t e; /* base type of the vector accessed by element instructions */
+};
+
+struct instruction_stream {
+        struct instruction *instructions;
+        int *offsets; /* bytecode offset of each instruction */
+        int len;
+        int translated; /* holds register code */
+};
+
+/* register instructions; operands are slots relative to stackbase */
+enum register_opcode {
+        OP_REG_MOVE = OP_HALT + 1, /* a = b */
+        OP_REG_LOADI, /* a = immediate b */
+        OP_REG_LOADK, /* a = constant b */
+        OP_REG_GET_OUTER, /* a = local c of the frame b levels out */
+        OP_REG_SET_OUTER, /* local c of the frame b levels out = a */
+        OP_REG_ADD, /* a = b + c */
+        OP_REG_ADDI, /* a = b + immediate c */
+        OP_REG_SUB,
+        OP_REG_MUL,
+        OP_REG_DIV,
+        OP_REG_GRT, /* integer comparisons */
+        OP_REG_GRTEQ,
+        OP_REG_LT,
+        OP_REG_LEQ,
+        OP_REG_EQ,
+        OP_REG_NOT, /* a = !b */
+        OP_REG_JUMP, /* ip += a */
+        OP_REG_JUMPF, /* ip += a if !b */
+        OP_REG_JUMP_NLT, /* ip += a unless b < c */
+        OP_REG_JUMP_NLEQ,
+        OP_REG_JUMP_NGRT,
+        OP_REG_JUMP_NGRTEQ,
+        OP_REG_JUMP_NEQ,
+        OP_REG_JUMP_EQ, /* ip += a if b == c */
+        OP_REG_SYNC, /* sp = stackbase + a, before stack instructions */
+        OP_REG_ENTER, /* check that a slots fit in the stack */
+};
+
+/* whole vector operations on integer vectors, see vector.c */
+struct vector_kernels {
+        void (*add)(void *dst, int32_t *left, int32_t *right, int n);
+        void (*sub)(void *dst, int32_t *left, int32_t *right, int n);
+        void (*mul)(void *dst, int32_t *left, int32_t *right, int n);
+        void (*grt)(void *dst, int32_t *left, int32_t *right, int n); /* comparisons store booleans */
+        void (*grteq)(void *dst, int32_t *left, int32_t *right, int n);
+        void (*lt)(void *dst, int32_t *left, int32_t *right, int n);
+        void (*leq)(void *dst, int32_t *left, int32_t *right, int n);
+        int (*sum)(int32_t *v, int n); /* reductions, n is at least 1 */
+        int (*min)(int32_t *v, int n);
+        int (*max)(int32_t *v, int n);
+        int (*count)(uint8_t *v, int n);
+        void (*matmul)(int32_t *dst, int32_t *left, int32_t *right, int n, int m, int p); /* n x m times m x p */
+};
+
+enum vm_backend {
+        VM_STACK,
+        VM_REGISTER,
+};
 
 struct stack_frame {
         union value *sp;
         union value *stackbase;
-        union value *asp;
-        int ip;
-        struct value_function fn;
+        char *asp; /* the array stack holds packed vectors, see vector_storage_size */
+        struct instruction *ip;
+        struct bytecode *code;
 };
 
+/* the stacks are mapped by vm_init, each one is followed by a guard page */
 struct vm {
         struct stack_frame *framese;
-        union value stack[STACK_MAX];
-        union value astack[STACK_MAX];
-        struct stack_frame framestack[STACK_MAX];
+        union value *stack;
+        union value *stackend;
+        char *astack;
+        char *astackend;
+        struct stack_frame *framestack;
+        struct stack_frame *framestackend;
+        struct bytecode *program;
+        struct bytecode **functions; /* function table of the program */
+        struct vector_kernels *kernels;
         union value argstack[MAX_ARITY];
         union value *argsp;
-        union value *argasp;
+        int string_threshold; /* string count triggering a collection, see gc.c */
+        char *line; /* buffer of OP_READ */
+        size_t linecap;
+        struct sigaction *old_segv; /* the SIGSEGV action vm_init replaced */
         int error;
 };
 
-void vm_init(struct vm *vm, struct bytecode *code);
-void stack_frame_init(struct stack_frame *sf, union value *sp, union value *stackbase, union value *asp, struct value_function fn);
+void vm_init(struct vm *vm, struct bytecode *code, enum vm_backend backend, int stack_size, int call_depth);
+void vm_free(struct vm *vm);
+void stack_frame_init(struct stack_frame *sf, union value *sp, union value *stackbase, char *asp, struct bytecode *code);
 int vm_run(struct vm *vm);
+void decode_bytecode(struct bytecode *code);
+void translate_to_registers(struct bytecode *code);
+struct vector_kernels *select_vector_kernels(void);
+void collect_strings(struct vm *vm);
 
 #endif
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,6 +40,9 @@ static char *progname = "";
 static int display_tree;
 static int display_bytecode;
 static int no_execute = 0;
+static enum vm_backend vm_backend = VM_STACK;
+static int stack_size = DEFAULT_STACK_SIZE;
+static int call_depth = DEFAULT_CALL_DEPTH;
 static int run_mode;
 static char *run_mode_str;
 static char *input_path = NULL;
@@ -58,7 +62,28 @@ print_help()
                 "--display-bytecode      show the bytecode. Applicable in all modes.\n"
                 "--no-execute            do not execute the program. Applicable in run and compile mode.\n"
                 "--output out_file       outputs compiled code to out_file. Applicable in compile mode.\n"
-              );
+                "--vm=stack|register     select the virtual machine (default stack). Applicable in run and execute mode.\n"
+                "--stack-size n          values the vm stacks can hold (default %d). Applicable in run and execute mode.\n"
+                "--call-depth n          maximum number of nested calls (default %d). Applicable in run and execute mode.\n"
+              , DEFAULT_STACK_SIZE, DEFAULT_CALL_DEPTH);
+}
+
+static int
+parse_size_argument(char *option, int *argcp, char ***argvp)
+{
+        char *end;
+        if (*argcp == 0) {
+                progerror("missing argument for option %s\n", option);
+                exit(1);
+        }
+        (*argcp)--;
+        char *arg = *((*argvp)++);
+        long size = strtol(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || size <= 0 || size > INT_MAX / 64) {
+                progerror("invalid size %s for option %s\n", arg, option);
+                exit(1);
+        }
+        return size;
 }
 
 static void
@@ -70,9 +95,17 @@ parse_option(char *option, int *argcp, char ***argvp)
                 display_bytecode = 1;
         } else if (strcmp(option, "--no-execute") == 0 && (run_mode == RUN_RUN || run_mode == RUN_EXECUTE)) {
                 no_execute = 1;
+        } else if (strcmp(option, "--vm=stack") == 0 && (run_mode == RUN_RUN || run_mode == RUN_EXECUTE)) {
+                vm_backend = VM_STACK;
+        } else if (strcmp(option, "--vm=register") == 0 && (run_mode == RUN_RUN || run_mode == RUN_EXECUTE)) {
+                vm_backend = VM_REGISTER;
         } else if (strcmp(option, "--output") == 0 && (run_mode == RUN_COMPILE)) {
                 (*argcp)--;
                 output_path = *((*argvp)++);
+        } else if (strcmp(option, "--stack-size") == 0 && (run_mode == RUN_RUN || run_mode == RUN_EXECUTE)) {
+                stack_size = parse_size_argument(option, argcp, argvp);
+        } else if (strcmp(option, "--call-depth") == 0 && (run_mode == RUN_RUN || run_mode == RUN_EXECUTE)) {
+                call_depth = parse_size_argument(option, argcp, argvp);
         } else {
                 progerror("unrecognized option %s in mode %s\n", option, run_mode_str);
                 exit(1);
@@ -218,8 +251,9 @@ execute_code(struct bytecode *code)
         if (no_execute)
                 return;
 
-        vm_init(&vm, code);
+        vm_init(&vm, code, vm_backend, stack_size, call_depth);
         vm_run(&vm);
+        vm_free(&vm);
 }
 
 static void
@@ -249,7 +283,7 @@ run_compile(char *programtext, int proglen)
 }
 
 static void
-run_execute(char *programtext, int proglen)
+run_execute(char *programtext)
 {
         struct bytecode code;
         deserialize_bytecode(&code, programtext);
@@ -277,7 +311,7 @@ main(int argc, char **argv)
                         break;
                 case RUN_EXECUTE:
                         programtext = load_program(input_path, &proglen);
-                        run_execute(programtext, proglen);
+                        run_execute(programtext);
                         break;
                 case RUN_HELP:
                         print_help();